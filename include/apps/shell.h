@@ -16,11 +16,14 @@ typedef struct {
     int history_count;
     int history_index;
     int exit_requested;
+    int top_active;
     char cwd[128];
 } shell_t;
 
 void shell_init(shell_t *shell, terminal_t *term);
 void shell_handle_key(shell_t *shell, const key_event_t *event);
 int shell_should_exit(const shell_t *shell);
+// Called about once a second; returns 1 if the terminal was redrawn.
+int shell_tick(shell_t *shell);
 
 #endif
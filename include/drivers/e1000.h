@@ -4,10 +4,28 @@
 #include "types.h"
 
 typedef void (*e1000_rx_cb)(const u8 *data, u16 len);
+// Runs in the interrupt handler; it should only wake whoever polls.
+typedef void (*e1000_irq_cb)(void);
+
+typedef struct {
+    u64 irqs;
+    u64 rx_packets;
+    u64 rx_polls;
+    u64 rx_budget_hits;
+    u32 rx_ring_size;
+    u32 rx_ring_peak;
+    u64 rx_ring_sum;
+    u64 rx_missed;
+    u64 rx_no_buffer;
+    u64 rx_overruns;
+} e1000_stats_t;
 
 int e1000_init(u8 mac_out[6]);
 void e1000_set_rx_callback(e1000_rx_cb cb);
-void e1000_poll(void);
+void e1000_set_irq_callback(e1000_irq_cb cb);
+int e1000_rx_pending(void);
+int e1000_rx_poll(int budget);
+void e1000_get_stats(e1000_stats_t *out);
 int e1000_send(const void *data, u16 len);
 
 #endif
@@ -20,6 +20,9 @@ void gfx_draw_text_clipped(const char *s, int x, int y, u32 color,
 void gfx_present(void);
 void gfx_present_rect(int x, int y, int w, int h);
 int gfx_backbuffer_enabled(void);
+void gfx_map_write_combining(void);
+const char *gfx_memory_type(void);
+u64 gfx_present_cycles(void);
 
 u64 gfx_width(void);
 u64 gfx_height(void);
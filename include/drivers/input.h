@@ -35,6 +35,9 @@ void input_init(void);
 void input_handle_scancode(u8 scancode);
 void input_handle_mouse_byte(u8 data);
 int input_poll_key(key_event_t *event);
+// Blocks until input is queued or timeout PIT ticks pass.
+int input_wait(u64 timeout);
+u64 input_take_arrival_ns(void);
 int input_poll_mouse(mouse_event_t *event);
 int input_is_shift_down(void);
 int input_is_alt_down(void);
@@ -0,0 +1,24 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "types.h"
+
+#define NSEC_PER_SEC  1000000000ull
+#define NSEC_PER_USEC 1000ull
+
+typedef enum {
+    CLOCK_SOURCE_NONE = 0,
+    CLOCK_SOURCE_CPUID,
+    CLOCK_SOURCE_PIT
+} clock_source_t;
+
+void clock_init(void);
+void clock_init_ap(void);
+u64 clock_monotonic_ns(void);
+u64 clock_tsc_hz(void);
+u64 clock_ns_to_tsc(u64 ns);
+u64 clock_tsc_to_ns(u64 cycles);
+bool clock_tsc_invariant(void);
+const char *clock_source_name(void);
+
+#endif
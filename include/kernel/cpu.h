@@ -5,6 +5,9 @@
 
 extern volatile u64 ticks;
 extern volatile u64 uptime_seconds;
+// ticks lags while the PIT is parked in tickless idle. Deadlines must be
+// computed from ticks_now() (kernel/task.c), which counts those ticks too.
+u64 ticks_now(void);
 
 #define PIT_HZ 60
 
@@ -42,10 +45,50 @@ static inline void io_wait(void) {
     outb(0x80, 0);
 }
 
+static inline u64 rdtsc(void) {
+    u32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+// The irqs-off tracer (irqstat.h) hooks the outermost save/restore pair.
+extern volatile bool irqtrace_enabled;
+void irqtrace_off(u64 rip);
+void irqtrace_on(u64 rip);
+
+static inline u64 irq_here(void) {
+    u64 rip;
+    asm volatile("lea 0(%%rip), %0" : "=r"(rip));
+    return rip;
+}
+
+static inline u64 irq_save(void) {
+    u64 flags;
+    asm volatile("pushfq\n"
+                 "popq %0\n"
+                 "cli"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    if (__builtin_expect(irqtrace_enabled, 0) && (flags & 0x200)) irqtrace_off(irq_here());
+    return flags;
+}
+
+static inline void irq_restore(u64 flags) {
+    if (flags & 0x200) {
+        if (__builtin_expect(irqtrace_enabled, 0)) irqtrace_on(irq_here());
+        asm volatile("sti" : : : "memory");
+    }
+}
+
 void pit_init(u32 frequency);
+void pit_stop(void);
 void timer_handler(void);
+void timer_advance(u64 elapsed);
 void cpu_get_vendor(char *vendor);
 void cpu_get_features(u32 *features_edx, u32 *features_ecx);
+void cpu_cpuid(u32 leaf, u32 subleaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx);
+bool cpu_tsc_invariant(void);
 void cpu_sleep_ticks(u64 sleep_ticks);
 u64 rdmsr(u32 msr);
 void wrmsr(u32 msr, u64 value);
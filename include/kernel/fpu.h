@@ -0,0 +1,37 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "types.h"
+
+// Per-task SIMD register state. The registers are switched lazily: a task
+// that never touches SSE/AVX never pays for a save or restore.
+typedef struct {
+    void *area;
+    void *alloc;
+    int last_cpu;
+} fpu_state_t;
+
+extern bool fpu_sse2;
+extern bool fpu_avx2;
+extern bool fpu_xsave;
+extern u32 fpu_area_size;
+extern u64 fpu_traps;
+extern u64 fpu_saves;
+extern u64 fpu_restores;
+
+void fpu_init(void);
+void fpu_init_ap(void);
+
+int fpu_state_init(fpu_state_t *state);
+void fpu_state_reset(fpu_state_t *state);
+void fpu_state_free(fpu_state_t *state);
+void fpu_switch(fpu_state_t *prev);
+void fpu_handle_nm(void);
+
+// Brackets kernel code that touches SSE/AVX registers. In a preemptible
+// task the section stays preemptible; with interrupts off (or before the
+// scheduler runs) the live owner is saved first. Sections may nest.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif
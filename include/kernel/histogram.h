@@ -0,0 +1,26 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "types.h"
+
+#define HIST_BUCKETS 32
+
+// Log2 histogram: bucket 0 counts values 0 and 1, bucket i > 0 counts
+// [2^i, 2^(i+1)). The unit is whatever the caller records.
+typedef struct {
+    u64 buckets[HIST_BUCKETS];
+    u64 count;
+    u64 sum;
+    u64 min;
+    u64 max;
+} histogram_t;
+
+void histogram_record(histogram_t *h, u64 value);
+// For histograms fed from several CPUs at once, e.g. from interrupts.
+void histogram_record_atomic(histogram_t *h, u64 value);
+void histogram_reset(histogram_t *h);
+// Upper bound of the bucket holding the pct-th percentile.
+u64 histogram_percentile(const histogram_t *h, u32 pct);
+u64 histogram_bucket_limit(u32 bucket);
+
+#endif
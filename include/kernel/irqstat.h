@@ -0,0 +1,37 @@
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include "types.h"
+#include "kernel/histogram.h"
+
+// Handler durations in ns, one histogram per legacy IRQ line plus one for
+// vector 0xF0 (LAPIC timer and reschedule IPI), which runs the scheduler.
+#define IRQSTAT_SCHED 16
+#define IRQSTAT_SLOTS 17
+
+#define IRQTRACE_RECORDS 8
+
+typedef struct {
+    u64 ns;
+    u64 start_rip;
+    u64 end_rip;
+    u32 cpu;
+} irqtrace_record_t;
+
+void irqstat_init(void);
+// Called on the way out of a handler with the TSC read on entry.
+void irqstat_record(u32 slot, u64 start_tsc);
+const histogram_t *irqstat_get(u32 slot);
+const char *irqstat_name(u32 slot);
+void irqstat_reset(void);
+
+// The irqs-off tracer keeps the IRQTRACE_RECORDS longest sections between
+// an irq_save that turned interrupts off and the irq_restore that turned
+// them back on. It costs a load and a branch per call while disabled.
+void irqtrace_set_enabled(bool on);
+bool irqtrace_is_enabled(void);
+void irqtrace_reset(void);
+u32 irqtrace_snapshot(irqtrace_record_t *out, u32 max);
+void irqtrace_dump_serial(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include "types.h"
+
+#define KSTACK_SIZE (32 * 1024)
+
+typedef struct {
+    u64 slots;
+    u64 in_use;
+    u64 cached;
+    u64 recycled;
+    bool guarded;
+} kstack_stats_t;
+
+extern kstack_stats_t kstack_stats;
+
+// Returns the lowest address of a KSTACK_SIZE kernel stack. Stacks live in
+// their own virtual region with an unmapped guard page below each one, so
+// an overflow never corrupts a neighbour. There are no IST stacks, though:
+// the #PF cannot be delivered on the overflowed stack, escalates to #DF
+// and then a triple fault, and the machine resets.
+void *kstack_alloc(void);
+// Keeps the stack mapped on a free list for the next kstack_alloc.
+void kstack_free(void *stack);
+
+#endif
@@ -3,11 +3,21 @@
 
 #include "types.h"
 
+// The scheduler takes the timer interrupt and cross-CPU reschedule IPIs
+// on the same vector; either one just runs the scheduler.
+#define LAPIC_TIMER_VECTOR   0xF0
+#define LAPIC_RESCHED_VECTOR LAPIC_TIMER_VECTOR
+
 void lapic_init(void);
 void lapic_init_ap(void);
 u32 lapic_id(void);
 void lapic_eoi(void);
+void lapic_send_ipi(u32 apic_id, u8 vector);
 void lapic_timer_setup(u32 hz);
+void lapic_timer_periodic_us(u32 period_us);
+void lapic_timer_oneshot_ns(u64 ns);
+void lapic_timer_stop(void);
+bool lapic_timer_has_deadline(void);
 u32 lapic_timer_ticks_per_sec(void);
 
 #endif
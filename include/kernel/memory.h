@@ -5,10 +5,14 @@
 
 struct limine_memmap_response;
 
+// Large-heap block header. Every block is followed by a u64 footer holding
+// its size so both physical neighbours can be found in constant time; the
+// free-list links are only meaningful while the block is free.
 typedef struct block {
     size_t size;
     bool free;
     struct block *next;
+    struct block *prev;
 } block_t;
 
 extern u64 pmm_total_pages;
@@ -18,21 +22,48 @@ extern u64 pmm_free_pages;
 extern u64 heap_allocated;
 extern u64 heap_freed;
 extern u64 heap_blocks;
+extern u64 heap_slabs;
+extern u64 heap_lock_contended;
+extern u64 heap_depot_refills;
+extern u64 heap_depot_flushes;
+extern u64 heap_arena_pages;
+extern u64 heap_direct_pages;
 
 void heap_init(void);
+void heap_update_stats(void);
 void *malloc(size_t size);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
 void free(void *ptr);
 
+#define PMM_MAX_ORDER 18
+
+// Tag stored on the head frame of a page_alloc() block.
+#define PAGE_OWNER_NONE        0
+#define PAGE_OWNER_HEAP_ARENA  1
+#define PAGE_OWNER_HEAP_SLAB   2
+#define PAGE_OWNER_HEAP_DIRECT 3
+#define PAGE_OWNER_KSTACK      4
+
 void pmm_init(void);
+void *page_alloc(u32 order, u64 *out_phys);
+void page_free(void *ptr);
+u32 page_order_for(size_t size);
+void page_set_owner(void *ptr, u8 owner);
+u8 page_owner(void *ptr);
+u32 page_block_order(void *ptr);
+u64 pmm_free_blocks(u32 order);
+u64 pmm_phys_top(void);
 
+void memory_init_dispatch(void);
+const char *memory_copy_impl(void);
 void memory_set_hhdm_offset(u64 offset);
 u64 memory_hhdm_offset(void);
 void memory_set_memmap(struct limine_memmap_response *memmap,
                        u64 kernel_phys_base, u64 kernel_phys_end);
 void *phys_to_virt(u64 phys);
 void *phys_alloc(size_t size, size_t align, u64 *out_phys);
+void phys_free(void *ptr);
 
 void *memset(void *s, int c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
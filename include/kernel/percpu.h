@@ -0,0 +1,65 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "types.h"
+#include "kernel/fpu.h"
+
+#define PERCPU_MAX 64
+
+struct task;
+struct runqueue;
+
+// Data owned by one CPU. Each copy fills whole cache lines so CPUs never
+// share one, and IA32_GS_BASE points at the local copy; self lets
+// this_cpu() find it with a single gs-relative load.
+typedef struct percpu {
+    struct percpu *self;
+    u32 index;
+    u32 lapic_id;
+    struct task *volatile current;
+    struct runqueue *rq;
+    // Set while the idle loop spins looking for work instead of halting.
+    volatile u32 idle_polling;
+    fpu_state_t *fpu_owner;
+    u32 fpu_depth;
+    u64 fpu_flags;
+    u64 irq_counts[16];
+    // Bit n set: softirq n raised on this CPU and not yet run.
+    volatile u32 softirq_pending;
+    // TSC on entry to the 0xF0 handler, for irqstat.
+    u64 isr_tsc;
+    // Start of the current irqs-off section, while the tracer is on.
+    u64 irqoff_tsc;
+    u64 irqoff_rip;
+} __attribute__((aligned(64))) percpu_t;
+
+extern percpu_t percpu_areas[PERCPU_MAX];
+
+// volatile: a task can migrate between two calls, so the load must not be
+// cached across them.
+static inline percpu_t *this_cpu(void) {
+    percpu_t *p;
+    asm volatile("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+// Reads one field of the local area in a single gs-relative instruction,
+// so it stays correct even if the task is preempted and migrates.
+#define this_cpu_read(field)                                        \
+    ({                                                              \
+        __typeof__(((percpu_t *)0)->field + 0) this_cpu_val_;       \
+        asm volatile("mov %%gs:%c1, %0"                             \
+                     : "=r"(this_cpu_val_)                          \
+                     : "i"(__builtin_offsetof(percpu_t, field)));   \
+        this_cpu_val_;                                              \
+    })
+
+static inline percpu_t *percpu_get(u32 cpu) {
+    return &percpu_areas[cpu < PERCPU_MAX ? cpu : 0];
+}
+
+// Points GS_BASE at the area for index. Must run on each CPU before
+// anything calls this_cpu().
+void percpu_init(u32 index);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef RING_H
+#define RING_H
+
+#include "types.h"
+
+// Bounded lock-free rings of fixed-size elements over caller-provided
+// storage, so they work before the heap is up. Capacity must be a power of
+// two; head and tail run freely and are masked on access. Producer and
+// consumer state sit on separate cache lines, and each side caches the
+// other's index so it only touches the remote line when it looks full or
+// empty. Enqueue and dequeue move up to n elements and return how many they
+// moved; they never block.
+
+#define RING_CACHELINE 64
+
+// One producer and one consumer. Each side may move between CPUs as long
+// as calls on that side are serialised.
+typedef struct {
+    volatile u32 head __attribute__((aligned(RING_CACHELINE)));
+    u32 tail_cache;
+    volatile u32 tail __attribute__((aligned(RING_CACHELINE)));
+    u32 head_cache;
+    u8 *buf __attribute__((aligned(RING_CACHELINE)));
+    u32 mask;
+    u32 size;
+} spsc_ring_t;
+
+int spsc_init(spsc_ring_t *r, void *storage, u32 capacity, u32 elem_size);
+// Empties the ring; neither side may be running.
+void spsc_reset(spsc_ring_t *r);
+u32 spsc_enqueue(spsc_ring_t *r, const void *items, u32 n);
+u32 spsc_dequeue(spsc_ring_t *r, void *items, u32 max);
+u32 spsc_count(const spsc_ring_t *r);
+
+static inline bool spsc_push(spsc_ring_t *r, const void *item) {
+    return spsc_enqueue(r, item, 1) == 1;
+}
+
+static inline bool spsc_pop(spsc_ring_t *r, void *item) {
+    return spsc_dequeue(r, item, 1) == 1;
+}
+
+// Any number of producers, one consumer. Producers reserve a run of slots
+// with a CAS on head and publish each slot through its sequence number, so
+// the consumer never reads a reserved slot before it is written.
+typedef struct {
+    volatile u32 head __attribute__((aligned(RING_CACHELINE)));
+    volatile u32 tail_cache;
+    volatile u32 tail __attribute__((aligned(RING_CACHELINE)));
+    u8 *slots __attribute__((aligned(RING_CACHELINE)));
+    u32 mask;
+    u32 size;
+    u32 stride;
+} mpsc_ring_t;
+
+// Bytes of storage an mpsc ring needs: a sequence word per slot.
+#define MPSC_SLOT_STRIDE(elem_size) ((((elem_size) + 4u) + 7u) & ~7u)
+#define MPSC_STORAGE_SIZE(capacity, elem_size) ((capacity) * MPSC_SLOT_STRIDE(elem_size))
+
+int mpsc_init(mpsc_ring_t *r, void *storage, u32 capacity, u32 elem_size);
+u32 mpsc_enqueue(mpsc_ring_t *r, const void *items, u32 n);
+u32 mpsc_dequeue(mpsc_ring_t *r, void *items, u32 max);
+bool mpsc_empty(const mpsc_ring_t *r);
+// True if the next slot the consumer would take has been published.
+bool mpsc_ready(const mpsc_ring_t *r);
+
+static inline bool mpsc_push(mpsc_ring_t *r, const void *item) {
+    return mpsc_enqueue(r, item, 1) == 1;
+}
+
+static inline bool mpsc_pop(mpsc_ring_t *r, void *item) {
+    return mpsc_dequeue(r, item, 1) == 1;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "types.h"
+
+// Deferred interrupt work. A handler raises a softirq to finish its work
+// right after the hard interrupt, on the same CPU, once the device has
+// been acknowledged. Softirq handlers run with interrupts off and must
+// not sleep; whatever is still pending after a few rounds moves to the
+// CPU's kworker task. Work that needs to sleep (take a mutex, wait on
+// I/O) goes on the workqueue instead, which the kworker runs in task
+// context.
+typedef enum {
+    SOFTIRQ_INPUT = 0,
+    SOFTIRQ_COUNT
+} softirq_t;
+
+typedef void (*softirq_handler_t)(void);
+
+struct work;
+typedef void (*work_fn_t)(struct work *work);
+
+// Embed in the owning object. A work item is on at most one queue; queuing
+// it again before it has started is a no-op.
+typedef struct work {
+    struct work *next;
+    work_fn_t fn;
+    volatile int pending;
+} work_t;
+
+typedef struct {
+    u64 raised;
+    u64 irq_exit_runs;
+    u64 deferred;
+    u64 work_done;
+} softirq_stats_t;
+
+// Creates one kworker per CPU; call after task_init.
+void softirq_init(u32 cpu_count);
+void softirq_register(softirq_t nr, softirq_handler_t handler);
+// From interrupt context: runs nr on this CPU before the interrupt returns.
+void softirq_raise(softirq_t nr);
+// Called as the last step of a hard interrupt handler.
+void softirq_irq_exit(void);
+
+void work_init(work_t *work, work_fn_t fn);
+// Queues work on this CPU's kworker; safe from interrupt context.
+bool work_queue(work_t *work);
+bool work_queue_on(u32 cpu, work_t *work);
+
+int softirq_get_stats(u32 cpu, softirq_stats_t *out);
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "types.h"
+#include "kernel/cpu.h"
+
+// Per-lock contention counters, attached with spin_lock_profile or
+// mcs_lock_profile. They are only written by the lock holder, so they need
+// no atomics; an unprofiled lock pays one well-predicted branch.
+typedef struct lock_stats {
+    const char *name;
+    int instance;
+    u64 acquisitions;
+    u64 contended;
+    u64 spin_cycles;
+    u64 hold_cycles;
+    u64 hold_max;
+    u64 hold_start;
+} lock_stats_t;
+
+#define LOCK_STATS_MAX 128
+
+void lock_stats_acquired(lock_stats_t *s, u64 spin_start);
+void lock_stats_released(lock_stats_t *s);
+lock_stats_t *lock_stats_register(const char *name, int instance);
+u32 lock_stats_count(void);
+int lock_stats_get(u32 index, lock_stats_t *out);
+void lock_stats_reset(void);
+
+// Ticket lock: waiters are served in arrival order and spin on a plain
+// load, so the line is only written by fetch_add and by the release.
+// The owner half is at the low address and only the holder stores to it.
+// All-zero is unlocked, so static locks need no initialisation.
+typedef struct {
+    union {
+        volatile u32 word;
+        struct {
+            volatile u16 owner;
+            volatile u16 next;
+        } t;
+    };
+    lock_stats_t *stats;
+} spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *l) {
+    l->word = 0;
+    l->stats = 0;
+}
+
+static inline void spin_lock_profile(spinlock_t *l, const char *name, int instance) {
+    l->stats = lock_stats_register(name, instance);
+}
+
+static inline void spin_lock(spinlock_t *l) {
+    u32 old = __atomic_fetch_add(&l->word, 1u << 16, __ATOMIC_ACQUIRE);
+    u16 me = (u16)(old >> 16);
+    if (__builtin_expect((u16)old == me, 1)) {
+        if (l->stats) lock_stats_acquired(l->stats, 0);
+        return;
+    }
+    u64 start = l->stats ? rdtsc() : 0;
+    while (__atomic_load_n(&l->t.owner, __ATOMIC_ACQUIRE) != me) {
+        asm volatile("pause");
+    }
+    if (l->stats) lock_stats_acquired(l->stats, start);
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    if (l->stats) lock_stats_released(l->stats);
+    __atomic_store_n(&l->t.owner, (u16)(l->t.owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline int spin_try_lock(spinlock_t *l) {
+    u32 old = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+    if ((u16)old != (u16)(old >> 16)) return 0;
+    if (!__atomic_compare_exchange_n(&l->word, &old, old + (1u << 16), false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (l->stats) lock_stats_acquired(l->stats, 0);
+    return 1;
+}
+
+static inline u64 spin_lock_irqsave(spinlock_t *l) {
+    u64 flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, u64 flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+}
+
+// MCS queued lock: each waiter spins on its own node, which lives on the
+// caller's stack for the duration of the critical section, so a handover
+// touches only the next waiter's line.
+typedef struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile int locked;
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t *volatile tail;
+    lock_stats_t *stats;
+} mcs_lock_t;
+
+static inline void mcs_lock_profile(mcs_lock_t *l, const char *name, int instance) {
+    l->stats = lock_stats_register(name, instance);
+}
+
+static inline void mcs_lock(mcs_lock_t *l, mcs_node_t *node) {
+    node->next = 0;
+    node->locked = 1;
+    mcs_node_t *prev = __atomic_exchange_n(&l->tail, node, __ATOMIC_ACQ_REL);
+    if (__builtin_expect(!prev, 1)) {
+        if (l->stats) lock_stats_acquired(l->stats, 0);
+        return;
+    }
+    u64 start = l->stats ? rdtsc() : 0;
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    if (l->stats) lock_stats_acquired(l->stats, start);
+}
+
+static inline int mcs_try_lock(mcs_lock_t *l, mcs_node_t *node) {
+    mcs_node_t *expected = 0;
+    node->next = 0;
+    node->locked = 0;
+    if (!__atomic_compare_exchange_n(&l->tail, &expected, node, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (l->stats) lock_stats_acquired(l->stats, 0);
+    return 1;
+}
+
+static inline void mcs_unlock(mcs_lock_t *l, mcs_node_t *node) {
+    if (l->stats) lock_stats_released(l->stats);
+    mcs_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        mcs_node_t *expected = node;
+        if (__atomic_compare_exchange_n(&l->tail, &expected, 0, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // A new waiter swapped itself in but has not linked up yet.
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline u64 mcs_lock_irqsave(mcs_lock_t *l, mcs_node_t *node) {
+    u64 flags = irq_save();
+    mcs_lock(l, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *l, mcs_node_t *node, u64 flags) {
+    mcs_unlock(l, node);
+    irq_restore(flags);
+}
+
+#endif
@@ -2,20 +2,84 @@
 #define TASK_H
 
 #include "types.h"
+#include "fpu.h"
 
 typedef void (*task_entry_t)(void *arg);
 
+struct task;
+
+// Scheduling classes, lowest first. A CPU always runs the highest class
+// with a ready task; a waking task preempts a lower class at once.
+typedef enum {
+    TASK_CLASS_BACKGROUND = 0,
+    TASK_CLASS_NORMAL,
+    TASK_CLASS_INTERACTIVE,
+    TASK_CLASS_COUNT
+} task_class_t;
+
+typedef struct {
+    bool online;
+    u32 queued;
+    const char *current;
+    u64 switches;
+    u64 steals;
+    u64 fast_path;
+    u64 kicks;
+    u64 poll_hits;
+    u64 preemptions;
+    u64 busy_ns;
+    u64 idle_ns;
+    bool tick_stopped;
+    u64 wakeups;
+    u32 wakeups_per_sec;
+} task_cpu_stats_t;
+
+typedef struct {
+    const char *name;
+    const char *state;
+    int cpu;
+    int affinity;
+    bool idle;
+    task_class_t cls;
+    u64 voluntary;
+    u64 involuntary;
+    u64 runtime_ns;
+    u64 wait_ns;
+} task_info_t;
+
 void task_init(u32 cpu_count);
 void task_register_cpu(u32 lapic_id, u32 index);
 int task_create(const char *name, task_entry_t entry, void *arg);
 int task_create_affinity(const char *name, task_entry_t entry, void *arg, int cpu);
+int task_create_class(const char *name, task_entry_t entry, void *arg, int cpu, task_class_t cls);
+int task_set_class(u32 index, task_class_t cls);
+const char *task_class_name(task_class_t cls);
 void task_start_bsp(void);
 void task_start_ap(void);
 void task_yield(void);
 void task_preempt(void);
-void task_tick(void);
 void task_sleep(u64 ticks);
+void sleep_ns(u64 ns);
+void sleep_us(u64 us);
+bool task_can_block(void);
+struct task *task_current(void);
+void task_block_prepare(u64 deadline);
+void task_block(void);
+void task_block_finish(void);
+void task_unblock(struct task *t);
 const char *task_current_name(void);
+int task_cpu_index(void);
+fpu_state_t *task_current_fpu(void);
 u64 task_schedule_isr(u64 rsp);
+void task_finish_switch(void);
+u32 task_cpu_count(void);
+int task_cpu_stats(u32 cpu, task_cpu_stats_t *out);
+u32 task_slots(void);
+u32 task_live_count(void);
+int task_info(u32 index, task_info_t *out);
+u32 task_quantum_us(void);
+int task_set_quantum_us(u32 us);
+u32 task_idle_poll_us(void);
+int task_set_idle_poll_us(u32 us);
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+typedef void (*timer_fn_t)(void *arg);
+typedef void (*timer_hook_t)(u64 expires);
+
+// One-shot timer keyed by an absolute PIT tick. Embed it in the owning
+// object; it needs no allocation and must stay valid while pending.
+typedef struct ktimer {
+    struct ktimer *next;
+    struct ktimer **pprev;
+    u64 expires;
+    timer_fn_t fn;
+    void *arg;
+} ktimer_t;
+
+typedef struct {
+    u64 pending;
+    u64 fired;
+    u64 cascaded;
+} timer_stats_t;
+
+extern timer_stats_t timer_stats;
+
+// Arms (or re-arms) t to call fn(arg) from the PIT interrupt once ticks
+// reaches expires. Callbacks run with interrupts off and must be short.
+void timer_add(ktimer_t *t, u64 expires, timer_fn_t fn, void *arg);
+bool timer_cancel(ktimer_t *t);
+bool timer_pending(const ktimer_t *t);
+void timer_run(u64 now);
+u64 timer_next_expiry(void);
+// Called after every timer_add; lets a stopped tick be restarted early.
+void timer_set_hook(timer_hook_t hook);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef VMM_H
+#define VMM_H
+
+#include "types.h"
+
+#define VMM_WRITE  (1u << 0)
+#define VMM_EXEC   (1u << 1)
+
+// Memory type of a mapping, stored in bits 4..6 of the flags.
+#define VMM_CACHE_WB       (0u << 4)
+#define VMM_CACHE_WT       (1u << 4)
+#define VMM_CACHE_UC_MINUS (2u << 4)
+#define VMM_CACHE_UC       (3u << 4)
+#define VMM_CACHE_WC       (4u << 4)
+#define VMM_CACHE_WP       (5u << 4)
+#define VMM_CACHE_MASK     (7u << 4)
+
+typedef struct {
+    u64 direct_map_base;
+    u64 direct_map_size;
+    u64 pages_1g;
+    u64 pages_2m;
+    u64 pages_4k;
+    u64 table_pages;
+    u64 splits;
+    u64 invlpg;
+    u64 full_flushes;
+    bool gb_pages;
+    bool nx;
+    bool global_pages;
+    bool pat;
+} vmm_stats_t;
+
+extern vmm_stats_t vmm_stats;
+
+void vmm_init(u64 kernel_phys_base, u64 kernel_virt_base);
+void vmm_init_ap(void);
+int vmm_map(u64 virt, u64 phys, u64 size, u32 flags);
+int vmm_unmap(u64 virt, u64 size);
+int vmm_protect(u64 virt, u64 size, u32 flags);
+u64 vmm_translate(u64 virt);
+int vmm_cache_type(u64 virt);
+void *vmm_map_mmio(u64 phys, u64 size, u32 cache);
+
+#endif
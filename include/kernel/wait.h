@@ -0,0 +1,82 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include "types.h"
+#include "kernel/spinlock.h"
+#include "kernel/task.h"
+
+// A wait queue holds tasks blocked until some condition turns true. The
+// entries live on the waiters' stacks.
+typedef struct wait_entry {
+    struct task *task;
+    struct wait_entry *next;
+} wait_entry_t;
+
+typedef struct {
+    spinlock_t lock;
+    wait_entry_t *head;
+} wait_queue_t;
+
+typedef struct {
+    volatile int locked;
+    wait_queue_t wait;
+} mutex_t;
+
+typedef struct {
+    volatile int count;
+    wait_queue_t wait;
+} semaphore_t;
+
+void wait_queue_init(wait_queue_t *wq);
+void wait_prepare(wait_queue_t *wq, wait_entry_t *entry, u64 deadline);
+void wait_finish(wait_queue_t *wq, wait_entry_t *entry);
+void wake_up(wait_queue_t *wq);
+void wake_up_one(wait_queue_t *wq);
+
+// Blocks until cond holds. The condition is checked again after the task
+// is queued, so a wake_up that races with the first check is not lost.
+// Outside a task (early boot, idle) it spins instead.
+#define wait_event(wq, cond)                            \
+    do {                                                \
+        wait_entry_t wait_entry_;                       \
+        while (!(cond)) {                               \
+            if (!task_can_block()) {                    \
+                asm volatile("pause");                  \
+                continue;                               \
+            }                                           \
+            wait_prepare(&(wq), &wait_entry_, 0);       \
+            if (!(cond)) task_block();                  \
+            wait_finish(&(wq), &wait_entry_);           \
+        }                                               \
+    } while (0)
+
+// Like wait_event but gives up after timeout PIT ticks. Evaluates to
+// nonzero if cond held.
+#define wait_event_timeout(wq, cond, timeout)           \
+    ({                                                  \
+        wait_entry_t wait_entry_;                       \
+        u64 wait_deadline_ = ticks_now() + (timeout);   \
+        while (!(cond) && ticks_now() < wait_deadline_) { \
+            if (!task_can_block()) {                    \
+                asm volatile("pause");                  \
+                continue;                               \
+            }                                           \
+            wait_prepare(&(wq), &wait_entry_, wait_deadline_); \
+            if (!(cond)) task_block();                  \
+            wait_finish(&(wq), &wait_entry_);           \
+        }                                               \
+        (cond);                                         \
+    })
+
+void mutex_init(mutex_t *m);
+void mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+
+void sem_init(semaphore_t *s, int count);
+void sem_down(semaphore_t *s);
+int sem_trydown(semaphore_t *s);
+int sem_down_timeout(semaphore_t *s, u64 timeout);
+void sem_up(semaphore_t *s);
+
+#endif
@@ -11,6 +11,9 @@ typedef enum log_level {
     LOG_LEVEL_DEBUG
 } log_level_t;
 
+// Lines that found the log ring full and were lost.
+extern u64 log_dropped;
+
 void log_init(void);
 void log_write(log_level_t level, const char *msg);
 void panic(const char *file, int line, const char *msg) __attribute__((noreturn));
@@ -4,7 +4,9 @@
 #include "types.h"
 
 void net_init(void);
-void net_poll(void);
+int net_poll(void);
+int net_wait_work(u64 timeout);
+int net_wait_until(int (*cond)(void), u64 timeout);
 int net_is_up(void);
 u32 net_get_ip(void);
 u32 net_get_dns(void);
@@ -15,6 +17,7 @@ int net_tcp_connect(u32 dest_ip, u16 dest_port);
 int net_tcp_is_established(void);
 int net_tcp_send(const u8 *data, u16 len);
 int net_tcp_recv(u8 *out, u16 max);
+int net_tcp_available(void);
 int net_tcp_is_closed(void);
 void net_tcp_close(void);
 
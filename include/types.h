@@ -20,7 +20,6 @@ typedef int32_t  i32;
 typedef int64_t  i64;
 
 #define PAGE_SIZE 4096
-#define HEAP_SIZE (32 * 1024 * 1024)
 
 #define COLOR_BLACK   0x000000
 #define COLOR_RED     0xFF0000
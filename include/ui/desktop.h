@@ -1,7 +1,10 @@
 #ifndef DESKTOP_H
 #define DESKTOP_H
 
+#include "kernel/histogram.h"
+
 void desktop_init(void);
 void desktop_loop(void);
+histogram_t *desktop_input_latency(void);
 
 #endif
@@ -157,17 +157,16 @@ static void browser_html_to_text(const char *in, char *out, u32 out_cap) {
     out[o] = 0;
 }
 
+static int browser_rx_ready(void) {
+    return net_tcp_available() || net_tcp_is_closed();
+}
+
 static void browser_fetch(browser_t *br) {
     if (!net_is_up()) {
         browser_set_status(br, "Waiting for network...");
-        u64 start = ticks;
-        while (!net_is_up()) {
-            net_poll();
-            if (ticks - start > PIT_HZ * 6) {
-                browser_set_status(br, "Network down");
-                return;
-            }
-            cpu_sleep_ticks(1);
+        if (!net_wait_until(net_is_up, PIT_HZ * 6)) {
+            browser_set_status(br, "Network down");
+            return;
         }
     }
     char host[96];
@@ -189,14 +188,9 @@ static void browser_fetch(browser_t *br) {
         browser_set_status(br, "Connect failed");
         return;
     }
-    u64 start = ticks;
-    while (!net_tcp_is_established()) {
-        net_poll();
-        if (ticks - start > PIT_HZ * 5) {
-            browser_set_status(br, "Connect timeout");
-            return;
-        }
-        cpu_sleep_ticks(1);
+    if (!net_wait_until(net_tcp_is_established, PIT_HZ * 5)) {
+        browser_set_status(br, "Connect timeout");
+        return;
     }
 
     char req[512];
@@ -220,9 +214,7 @@ static void browser_fetch(browser_t *br) {
         return;
     }
     u32 raw_len = 0;
-    u64 last_rx = ticks;
-    while (!net_tcp_is_closed()) {
-        net_poll();
+    while (!net_tcp_is_closed() || net_tcp_available()) {
         u8 tmp[512];
         int got = net_tcp_recv(tmp, sizeof(tmp));
         if (got > 0) {
@@ -230,10 +222,9 @@ static void browser_fetch(browser_t *br) {
                 memcpy(raw + raw_len, tmp, (u32)got);
                 raw_len += (u32)got;
             }
-            last_rx = ticks;
+            continue;
         }
-        if (ticks - last_rx > PIT_HZ * 5) break;
-        cpu_sleep_ticks(1);
+        if (!net_wait_until(browser_rx_ready, PIT_HZ * 5)) break;
     }
     net_tcp_close();
 
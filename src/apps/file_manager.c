@@ -61,12 +61,12 @@ static void fm_set_status(file_manager_t *fm, const char *msg) {
     if (len >= (int)sizeof(fm->status)) len = (int)sizeof(fm->status) - 1;
     memcpy(fm->status, msg, (size_t)len);
     fm->status[len] = 0;
-    fm->status_until = ticks + PIT_HZ * 2;
+    fm->status_until = ticks_now() + PIT_HZ * 2;
 }
 
 static int fm_status_active(const file_manager_t *fm) {
     if (fm->status[0] == 0) return 0;
-    if (ticks > fm->status_until) return 0;
+    if (ticks_now() > fm->status_until) return 0;
     return 1;
 }
 
@@ -1,8 +1,22 @@
 #include "apps/shell.h"
 #include "kernel/memory.h"
 #include "kernel/cpu.h"
+#include "kernel/vmm.h"
+#include "kernel/fpu.h"
+#include "kernel/task.h"
+#include "kernel/timer.h"
+#include "kernel/clock.h"
+#include "kernel/kstack.h"
+#include "kernel/wait.h"
+#include "kernel/percpu.h"
+#include "kernel/irqstat.h"
+#include "kernel/softirq.h"
+#include "kernel/spinlock.h"
+#include "kernel/ring.h"
 #include "services/net.h"
+#include "drivers/e1000.h"
 #include "services/fs.h"
+#include "ui/desktop.h"
 
 static void shell_prompt(shell_t *shell) {
     terminal_print(shell->term, "fusion");
@@ -27,12 +41,20 @@ static const char *const shell_commands[] = {
     "meminfo",
     "mem",
     "heapinfo",
+    "vmm",
     "malloc",
     "uptime",
     "time",
     "date",
     "ticks",
     "cpuinfo",
+    "sched",
+    "latency",
+    "top",
+    "ps",
+    "irqstat",
+    "locks",
+    "ringbench",
     "color",
     "copy",
     "paste",
@@ -170,6 +192,237 @@ static void print_dec(terminal_t *term, u64 n) {
     terminal_print(term, &buf[i]);
 }
 
+static semaphore_t spawn_done;
+static volatile u64 spawn_work;
+
+static void spawn_worker(void *arg) {
+    __sync_fetch_and_add(&spawn_work, (u64)(uintptr_t)arg);
+    sem_up(&spawn_done);
+}
+
+// sched pingpong: two tasks pinned to different CPUs hand a token back
+// and forth; every round trip is two cross-CPU wakeups.
+static semaphore_t pp_ping;
+static semaphore_t pp_pong;
+static semaphore_t pp_done;
+static u32 pp_rounds;
+static histogram_t pp_rtt;
+
+static void pingpong_server(void *arg) {
+    (void)arg;
+    for (u32 i = 0; i < pp_rounds; i++) {
+        sem_down(&pp_ping);
+        sem_up(&pp_pong);
+    }
+    sem_up(&pp_done);
+}
+
+static void pingpong_client(void *arg) {
+    (void)arg;
+    for (u32 i = 0; i < pp_rounds; i++) {
+        u64 start = clock_monotonic_ns();
+        sem_up(&pp_ping);
+        sem_down(&pp_pong);
+        histogram_record(&pp_rtt, clock_monotonic_ns() - start);
+    }
+    sem_up(&pp_done);
+}
+
+// ringbench: producers pinned to cpu1.. stream tagged sequence numbers to
+// a consumer on cpu0, which checks each producer's order. Both sides spin
+// on a full or empty ring, so this measures the ring and the cache-line
+// traffic, not wakeups.
+#define RB_CAPACITY 1024
+#define RB_BATCH 32
+#define RB_MAX_PRODUCERS 3
+
+static u64 rb_spsc_storage[RB_CAPACITY];
+static u8 rb_mpsc_storage[MPSC_STORAGE_SIZE(RB_CAPACITY, sizeof(u64))] __attribute__((aligned(8)));
+static spsc_ring_t rb_spsc;
+static mpsc_ring_t rb_mpsc;
+static bool rb_use_mpsc;
+static u32 rb_batch;
+static u32 rb_producers;
+static u64 rb_per_producer;
+static volatile u64 rb_total;
+static u64 rb_errors;
+static u64 rb_ns;
+static semaphore_t rb_done;
+
+static u32 rb_enqueue(const u64 *items, u32 n) {
+    return rb_use_mpsc ? mpsc_enqueue(&rb_mpsc, items, n) : spsc_enqueue(&rb_spsc, items, n);
+}
+
+static u32 rb_dequeue(u64 *items, u32 max) {
+    return rb_use_mpsc ? mpsc_dequeue(&rb_mpsc, items, max) : spsc_dequeue(&rb_spsc, items, max);
+}
+
+static void ring_producer(void *arg) {
+    u64 tag = (u64)(uintptr_t)arg << 48;
+    u64 items[RB_BATCH];
+    u64 v = 0;
+    while (v < rb_per_producer) {
+        u32 n = rb_batch;
+        if (n > rb_per_producer - v) n = (u32)(rb_per_producer - v);
+        for (u32 i = 0; i < n; i++) items[i] = tag | (v + i);
+        u32 sent = 0;
+        while (sent < n) {
+            u32 k = rb_enqueue(items + sent, n - sent);
+            if (!k) asm volatile("pause");
+            sent += k;
+        }
+        v += n;
+    }
+    sem_up(&rb_done);
+}
+
+static void ring_consumer(void *arg) {
+    (void)arg;
+    u64 next[RB_MAX_PRODUCERS] = {0};
+    u64 items[RB_BATCH];
+    u64 got = 0;
+    u64 start = 0;
+    while (got < rb_total) {
+        u32 n = rb_dequeue(items, rb_batch);
+        if (!n) {
+            asm volatile("pause");
+            continue;
+        }
+        if (!start) start = clock_monotonic_ns();
+        for (u32 i = 0; i < n; i++) {
+            u32 id = (u32)(items[i] >> 48);
+            u64 seq = items[i] & 0xFFFFFFFFFFFFull;
+            if (id >= RB_MAX_PRODUCERS || seq != next[id]) rb_errors++;
+            else next[id]++;
+        }
+        got += n;
+    }
+    rb_ns = clock_monotonic_ns() - start;
+    sem_up(&rb_done);
+}
+
+// Right-aligns n in a field of width columns.
+static void print_dec_width(terminal_t *term, u64 n, int width) {
+    int digits = 1;
+    for (u64 v = n; v >= 10; v /= 10) digits++;
+    while (width-- > digits) terminal_putc(term, ' ');
+    print_dec(term, n);
+}
+
+// part/whole as a percentage with one decimal, right-aligned in 5 columns.
+static void print_pct(terminal_t *term, u64 part, u64 whole) {
+    u64 tenths = whole ? part * 1000 / whole : 0;
+    if (tenths > 1000) tenths = 1000;
+    print_dec_width(term, tenths / 10, 3);
+    terminal_putc(term, '.');
+    terminal_putc(term, (char)('0' + tenths % 10));
+    terminal_putc(term, '%');
+}
+
+#define TOP_ROWS 12
+
+// The live top view keeps the previous sample so each refresh shows
+// usage over the last interval. One terminal runs it at a time.
+static struct {
+    shell_t *owner;
+    u64 sample_ns;
+    u64 *task_ns;
+    u32 task_slots;
+    u64 cpu_busy_ns[PERCPU_MAX];
+    u64 cpu_idle_ns[PERCPU_MAX];
+} top_state;
+
+static void print_task_row(terminal_t *term, u32 id, const task_info_t *info) {
+    print_dec_width(term, id, 6);
+    print_dec_width(term, info->runtime_ns / 1000000, 9);
+    print_dec_width(term, info->wait_ns / 1000000, 9);
+    print_dec_width(term, info->voluntary + info->involuntary, 9);
+    print_dec_width(term, (u64)(info->cpu < 0 ? 0 : info->cpu), 4);
+    terminal_putc(term, ' ');
+    const char *cls = task_class_name(info->cls);
+    terminal_print(term, cls);
+    for (int pad = (int)strlen(cls); pad < 12; pad++) terminal_putc(term, ' ');
+    terminal_print(term, info->state);
+    for (int pad = (int)strlen(info->state); pad < 9; pad++) terminal_putc(term, ' ');
+    terminal_print(term, info->name);
+    terminal_putc(term, '\n');
+}
+
+static void top_render(shell_t *shell) {
+    terminal_t *term = shell->term;
+    u64 now = clock_monotonic_ns();
+    u64 elapsed = now - top_state.sample_ns;
+    top_state.sample_ns = now;
+
+    u32 slots = task_slots();
+    if (slots > top_state.task_slots) {
+        u64 *grown = (u64 *)realloc(top_state.task_ns, slots * sizeof(u64));
+        if (grown) {
+            memset(grown + top_state.task_slots, 0, (slots - top_state.task_slots) * sizeof(u64));
+            top_state.task_ns = grown;
+            top_state.task_slots = slots;
+        }
+    }
+
+    terminal_clear(term);
+    terminal_print(term, "top - up ");
+    print_dec(term, uptime_seconds);
+    terminal_print(term, " s, ");
+    print_dec(term, task_live_count());
+    terminal_print(term, " tasks (any key to quit)\n");
+    for (u32 cpu = 0; cpu < task_cpu_count() && cpu < PERCPU_MAX; cpu++) {
+        task_cpu_stats_t st;
+        if (task_cpu_stats(cpu, &st) != 0 || !st.online) continue;
+        u64 busy = st.busy_ns - top_state.cpu_busy_ns[cpu];
+        u64 idle = st.idle_ns - top_state.cpu_idle_ns[cpu];
+        top_state.cpu_busy_ns[cpu] = st.busy_ns;
+        top_state.cpu_idle_ns[cpu] = st.idle_ns;
+        terminal_print(term, "  cpu");
+        print_dec(term, cpu);
+        terminal_putc(term, ' ');
+        print_pct(term, busy, busy + idle);
+        terminal_print(term, " busy ");
+        print_pct(term, idle, busy + idle);
+        terminal_print(term, " idle  ");
+        terminal_print(term, st.current);
+        terminal_putc(term, '\n');
+    }
+
+    // Keep the TOP_ROWS tasks that ran the most since the last sample.
+    u32 top_id[TOP_ROWS];
+    u64 top_ns[TOP_ROWS];
+    u32 shown = 0;
+    for (u32 i = 0; i < slots; i++) {
+        task_info_t info;
+        if (task_info(i, &info) != 0 || info.idle) continue;
+        u64 prev = i < top_state.task_slots ? top_state.task_ns[i] : 0;
+        // A lower total means the slot now holds a different task.
+        u64 delta = info.runtime_ns >= prev ? info.runtime_ns - prev : info.runtime_ns;
+        if (i < top_state.task_slots) top_state.task_ns[i] = info.runtime_ns;
+        u32 pos = shown < TOP_ROWS ? shown++ : TOP_ROWS;
+        while (pos > 0 && top_ns[pos - 1] < delta) {
+            if (pos < TOP_ROWS) {
+                top_id[pos] = top_id[pos - 1];
+                top_ns[pos] = top_ns[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < TOP_ROWS) {
+            top_id[pos] = i;
+            top_ns[pos] = delta;
+        }
+    }
+
+    terminal_print(term, "\n  CPU%     ID   CPU ms  WAIT ms SWITCHES CPU CLASS       STATE    NAME\n");
+    for (u32 row = 0; row < shown; row++) {
+        task_info_t info;
+        if (task_info(top_id[row], &info) != 0) continue;
+        terminal_putc(term, ' ');
+        print_pct(term, top_ns[row], elapsed);
+        print_task_row(term, top_id[row], &info);
+    }
+}
+
 static void print_hex_byte(terminal_t *term, u8 v) {
     const char *hex = "0123456789abcdef";
     char buf[3];
@@ -363,7 +616,8 @@ static void execute_command(shell_t *shell, char *cmd) {
     if (strcmp(args[0], "help") == 0) {
         terminal_print(shell->term, "Available commands:\n");
         terminal_print(shell->term, "  clear/cls, echo, uname/version, whoami\n");
-        terminal_print(shell->term, "  meminfo/mem, heapinfo, malloc, cpuinfo\n");
+        terminal_print(shell->term, "  meminfo/mem, heapinfo, vmm, malloc, cpuinfo, sched, latency\n");
+        terminal_print(shell->term, "  top, ps, irqstat, locks, ringbench\n");
         terminal_print(shell->term, "  uptime/time/date, ticks\n");
         terminal_print(shell->term, "  color, copy, paste, netinfo/ip\n");
         terminal_print(shell->term, "  ls/dir, pwd, cd, cat/type\n");
@@ -396,11 +650,23 @@ static void execute_command(shell_t *shell, char *cmd) {
         print_dec(shell->term, pmm_free_pages);
         terminal_print(shell->term, "\n  Used Pages:  ");
         print_dec(shell->term, pmm_used_pages);
-        terminal_putc(shell->term, '\n');
+        terminal_print(shell->term, "\n  Free blocks by order:\n");
+        for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+            u64 blocks = pmm_free_blocks(order);
+            if (blocks == 0) continue;
+            terminal_print(shell->term, "    ");
+            print_dec(shell->term, order);
+            terminal_print(shell->term, ": ");
+            print_dec(shell->term, blocks);
+            terminal_putc(shell->term, '\n');
+        }
     } else if (strcmp(args[0], "heapinfo") == 0) {
+        heap_update_stats();
         terminal_print(shell->term, "Heap Allocator Statistics:\n");
-        terminal_print(shell->term, "  Heap Size:       ");
-        print_dec(shell->term, HEAP_SIZE / 1024);
+        terminal_print(shell->term, "  Arena Size:      ");
+        print_dec(shell->term, heap_arena_pages * PAGE_SIZE / 1024);
+        terminal_print(shell->term, " KB\n  Direct Pages:    ");
+        print_dec(shell->term, heap_direct_pages * PAGE_SIZE / 1024);
         terminal_print(shell->term, " KB\n  Allocated:       ");
         print_dec(shell->term, heap_allocated);
         terminal_print(shell->term, " bytes\n  Freed:           ");
@@ -409,6 +675,40 @@ static void execute_command(shell_t *shell, char *cmd) {
         print_dec(shell->term, heap_allocated - heap_freed);
         terminal_print(shell->term, " bytes\n  Active Blocks:   ");
         print_dec(shell->term, heap_blocks);
+        terminal_print(shell->term, "\n  Slabs:           ");
+        print_dec(shell->term, heap_slabs);
+        terminal_print(shell->term, "\n  Depot Refills:   ");
+        print_dec(shell->term, heap_depot_refills);
+        terminal_print(shell->term, "\n  Depot Flushes:   ");
+        print_dec(shell->term, heap_depot_flushes);
+        terminal_print(shell->term, "\n  Lock Contended:  ");
+        print_dec(shell->term, heap_lock_contended);
+        terminal_putc(shell->term, '\n');
+    } else if (strcmp(args[0], "vmm") == 0) {
+        terminal_print(shell->term, "Kernel Page Tables:\n");
+        terminal_print(shell->term, "  Direct Map:      ");
+        print_hex(shell->term, vmm_stats.direct_map_base);
+        terminal_print(shell->term, " (");
+        print_dec(shell->term, vmm_stats.direct_map_size / (1024 * 1024));
+        terminal_print(shell->term, " MB)\n  1 GiB Pages:     ");
+        print_dec(shell->term, vmm_stats.pages_1g);
+        terminal_print(shell->term, vmm_stats.gb_pages ? "\n" : " (unsupported)\n");
+        terminal_print(shell->term, "  2 MiB Pages:     ");
+        print_dec(shell->term, vmm_stats.pages_2m);
+        terminal_print(shell->term, "\n  4 KiB Pages:     ");
+        print_dec(shell->term, vmm_stats.pages_4k);
+        terminal_print(shell->term, "\n  Table Pages:     ");
+        print_dec(shell->term, vmm_stats.table_pages);
+        terminal_print(shell->term, "\n  Splits:          ");
+        print_dec(shell->term, vmm_stats.splits);
+        terminal_print(shell->term, "\n  INVLPG:          ");
+        print_dec(shell->term, vmm_stats.invlpg);
+        terminal_print(shell->term, "\n  Full Flushes:    ");
+        print_dec(shell->term, vmm_stats.full_flushes);
+        terminal_print(shell->term, "\n  NX:              ");
+        terminal_print(shell->term, vmm_stats.nx ? "on" : "off");
+        terminal_print(shell->term, "\n  Global Pages:    ");
+        terminal_print(shell->term, vmm_stats.global_pages ? "on" : "off");
         terminal_putc(shell->term, '\n');
     } else if (strcmp(args[0], "mem") == 0) {
         terminal_print(shell->term, "Total: ");
@@ -463,7 +763,468 @@ static void execute_command(shell_t *shell, char *cmd) {
         char vendor[13];
         cpu_get_vendor(vendor);
         terminal_print(shell->term, vendor);
-        terminal_putc(shell->term, '\n');
+        terminal_print(shell->term, "\n  SIMD:   ");
+        terminal_print(shell->term, fpu_avx2 ? "AVX2" : fpu_sse2 ? "SSE2" : "none");
+        terminal_print(shell->term, fpu_xsave ? ", XSAVE" : "");
+        terminal_print(shell->term, "\n  memcpy: ");
+        terminal_print(shell->term, memory_copy_impl());
+        terminal_print(shell->term, "\n  FPU:    ");
+        print_dec(shell->term, fpu_area_size);
+        terminal_print(shell->term, "B state, ");
+        print_dec(shell->term, fpu_traps);
+        terminal_print(shell->term, " traps, ");
+        print_dec(shell->term, fpu_saves);
+        terminal_print(shell->term, " saves, ");
+        print_dec(shell->term, fpu_restores);
+        terminal_print(shell->term, " restores\n  Clock:  TSC ");
+        print_dec(shell->term, clock_tsc_hz() / 1000000);
+        terminal_print(shell->term, " MHz via ");
+        terminal_print(shell->term, clock_source_name());
+        terminal_print(shell->term, clock_tsc_invariant() ? ", invariant\n" : ", not invariant\n");
+    } else if (strcmp(args[0], "sched") == 0) {
+        if (argc >= 2 && strcmp(args[1], "quantum") == 0) {
+            if (argc < 3) {
+                terminal_print(shell->term, "Usage: sched quantum <us>\n");
+            } else {
+                u64 us = 0;
+                for (char *q = args[2]; *q; q++) if (*q >= '0' && *q <= '9') us = us * 10 + (*q - '0');
+                if (us > 0xFFFFFFFFu || task_set_quantum_us((u32)us) != 0) {
+                    terminal_print(shell->term, "Quantum must be 100..1000000 us\n");
+                } else {
+                    terminal_print(shell->term, "Quantum set to ");
+                    print_dec(shell->term, us);
+                    terminal_print(shell->term, " us\n");
+                }
+            }
+        } else if (argc >= 2 && strcmp(args[1], "poll") == 0) {
+            if (argc < 3) {
+                terminal_print(shell->term, "Idle poll window ");
+                print_dec(shell->term, task_idle_poll_us());
+                terminal_print(shell->term, " us\n");
+            } else {
+                u64 us = 0;
+                for (char *q = args[2]; *q; q++) if (*q >= '0' && *q <= '9') us = us * 10 + (*q - '0');
+                if (us > 0xFFFFFFFFu || task_set_idle_poll_us((u32)us) != 0) {
+                    terminal_print(shell->term, "Poll window must be 0..10000 us\n");
+                } else {
+                    terminal_print(shell->term, "Idle poll window set to ");
+                    print_dec(shell->term, us);
+                    terminal_print(shell->term, " us\n");
+                }
+            }
+        } else if (argc >= 2 && strcmp(args[1], "pingpong") == 0) {
+            u64 n = 1000;
+            if (argc >= 3) {
+                n = 0;
+                for (char *q = args[2]; *q; q++) if (*q >= '0' && *q <= '9') n = n * 10 + (*q - '0');
+            }
+            task_cpu_stats_t st;
+            if (n == 0 || n > 100000) {
+                terminal_print(shell->term, "Usage: sched pingpong [1..100000]\n");
+            } else if (task_cpu_count() < 2 || task_cpu_stats(1, &st) != 0 || !st.online) {
+                terminal_print(shell->term, "Needs a second CPU\n");
+            } else {
+                // Once with the idle CPU halting between rounds, once
+                // with the configured poll window.
+                u32 poll = task_idle_poll_us();
+                terminal_print(shell->term, "Cross-CPU round trip (ns), cpu0 <-> cpu1:\n");
+                for (int pass = 0; pass < 2; pass++) {
+                    if (pass == 1 && poll == 0) break;
+                    task_set_idle_poll_us(pass == 0 ? 0 : poll);
+                    sem_init(&pp_ping, 0);
+                    sem_init(&pp_pong, 0);
+                    sem_init(&pp_done, 0);
+                    histogram_reset(&pp_rtt);
+                    pp_rounds = (u32)n;
+                    int started = 0;
+                    if (task_create_affinity("pp-server", pingpong_server, NULL, 1) >= 0) started++;
+                    if (started && task_create_affinity("pp-client", pingpong_client, NULL, 0) >= 0) started++;
+                    if (started < 2) {
+                        // Let a lone server run out and exit.
+                        pp_rounds = 0;
+                        if (started) {
+                            sem_up(&pp_ping);
+                            sem_down(&pp_done);
+                        }
+                        terminal_print(shell->term, "  Could not start tasks\n");
+                        break;
+                    }
+                    sem_down(&pp_done);
+                    sem_down(&pp_done);
+                    terminal_print(shell->term, pass == 0 ? "  halt:    " : "  poll:    ");
+                    print_dec(shell->term, pp_rtt.count ? pp_rtt.sum / pp_rtt.count : 0);
+                    terminal_print(shell->term, " avg, p50 ");
+                    print_dec(shell->term, histogram_percentile(&pp_rtt, 50));
+                    terminal_print(shell->term, ", p99 ");
+                    print_dec(shell->term, histogram_percentile(&pp_rtt, 99));
+                    terminal_print(shell->term, ", max ");
+                    print_dec(shell->term, pp_rtt.max);
+                    terminal_putc(shell->term, '\n');
+                }
+                task_set_idle_poll_us(poll);
+            }
+        } else if (argc >= 2 && strcmp(args[1], "spawn") == 0) {
+            u64 n = 0;
+            if (argc >= 3) {
+                for (char *q = args[2]; *q; q++) if (*q >= '0' && *q <= '9') n = n * 10 + (*q - '0');
+            }
+            if (n == 0 || n > 100000) {
+                terminal_print(shell->term, "Usage: sched spawn <1..100000>\n");
+            } else {
+                sem_init(&spawn_done, 0);
+                spawn_work = 0;
+                u64 start = clock_monotonic_ns();
+                u64 running = 0;
+                for (u64 i = 0; i < n; i++) {
+                    // Out of slots or stacks: wait for an earlier worker.
+                    int id;
+                    while ((id = task_create("worker", spawn_worker, (void *)(uintptr_t)1)) < 0 && running > 0) {
+                        sem_down(&spawn_done);
+                        running--;
+                    }
+                    if (id < 0) break;
+                    running++;
+                }
+                while (running--) sem_down(&spawn_done);
+                u64 us = (clock_monotonic_ns() - start) / NSEC_PER_USEC;
+                terminal_print(shell->term, "Ran ");
+                print_dec(shell->term, spawn_work);
+                terminal_print(shell->term, " workers in ");
+                print_dec(shell->term, us);
+                terminal_print(shell->term, " us (");
+                print_dec(shell->term, spawn_work ? us * 1000 / spawn_work : 0);
+                terminal_print(shell->term, " ns each)\n  Task slots ");
+                print_dec(shell->term, task_slots());
+                terminal_print(shell->term, ", stacks ");
+                print_dec(shell->term, kstack_stats.slots);
+                terminal_print(shell->term, " mapped, ");
+                print_dec(shell->term, kstack_stats.recycled);
+                terminal_print(shell->term, " recycled");
+                terminal_print(shell->term, kstack_stats.guarded ? ", guarded\n" : ", unguarded\n");
+            }
+        } else if (argc >= 2 && strcmp(args[1], "class") == 0) {
+            task_class_t cls = TASK_CLASS_COUNT;
+            if (argc >= 4) {
+                if (strcmp(args[3], "interactive") == 0) cls = TASK_CLASS_INTERACTIVE;
+                else if (strcmp(args[3], "normal") == 0) cls = TASK_CLASS_NORMAL;
+                else if (strcmp(args[3], "background") == 0) cls = TASK_CLASS_BACKGROUND;
+            }
+            if (cls == TASK_CLASS_COUNT) {
+                terminal_print(shell->term, "Usage: sched class <task#> <interactive|normal|background>\n");
+            } else {
+                u64 id = 0;
+                for (char *q = args[2]; *q; q++) if (*q >= '0' && *q <= '9') id = id * 10 + (*q - '0');
+                if (id > 0xFFFFFFFFu || task_set_class((u32)id, cls) != 0) {
+                    terminal_print(shell->term, "No such task\n");
+                } else {
+                    terminal_print(shell->term, "Task ");
+                    print_dec(shell->term, id);
+                    terminal_print(shell->term, " is now ");
+                    terminal_print(shell->term, task_class_name(cls));
+                    terminal_putc(shell->term, '\n');
+                }
+            }
+        } else {
+            terminal_print(shell->term, "Scheduler (quantum ");
+            print_dec(shell->term, task_quantum_us());
+            terminal_print(shell->term, " us):\n");
+            for (u32 cpu = 0; cpu < task_cpu_count(); cpu++) {
+                task_cpu_stats_t st;
+                if (task_cpu_stats(cpu, &st) != 0 || !st.online) continue;
+                terminal_print(shell->term, "  cpu");
+                print_dec(shell->term, cpu);
+                terminal_print(shell->term, ": ");
+                terminal_print(shell->term, st.current);
+                terminal_print(shell->term, ", ");
+                print_dec(shell->term, st.queued);
+                terminal_print(shell->term, " queued\n    switches ");
+                print_dec(shell->term, st.switches);
+                terminal_print(shell->term, ", preempt ");
+                print_dec(shell->term, st.preemptions);
+                terminal_print(shell->term, ", steals ");
+                print_dec(shell->term, st.steals);
+                terminal_print(shell->term, ", fast path ");
+                print_dec(shell->term, st.fast_path);
+                terminal_print(shell->term, ", kicks ");
+                print_dec(shell->term, st.kicks);
+                terminal_print(shell->term, ", poll hits ");
+                print_dec(shell->term, st.poll_hits);
+                terminal_print(shell->term, "\n    idle wakeups ");
+                print_dec(shell->term, st.wakeups_per_sec);
+                terminal_print(shell->term, "/s, tick ");
+                terminal_print(shell->term, st.tick_stopped ? "stopped" : "running");
+                terminal_putc(shell->term, '\n');
+            }
+            terminal_print(shell->term, "  Timers: ");
+            print_dec(shell->term, timer_stats.pending);
+            terminal_print(shell->term, " pending, ");
+            print_dec(shell->term, timer_stats.fired);
+            terminal_print(shell->term, " fired, ");
+            print_dec(shell->term, timer_stats.cascaded);
+            terminal_print(shell->term, " cascaded\n");
+            terminal_print(shell->term, "  Tasks (voluntary/involuntary switches):\n");
+            for (u32 i = 0; i < task_slots(); i++) {
+                task_info_t info;
+                if (task_info(i, &info) != 0 || info.idle) continue;
+                terminal_print(shell->term, "    #");
+                print_dec(shell->term, i);
+                terminal_putc(shell->term, ' ');
+                terminal_print(shell->term, info.name);
+                terminal_print(shell->term, " [");
+                terminal_print(shell->term, info.state);
+                terminal_print(shell->term, ", ");
+                terminal_print(shell->term, task_class_name(info.cls));
+                terminal_print(shell->term, "] ");
+                print_dec(shell->term, info.voluntary);
+                terminal_putc(shell->term, '/');
+                print_dec(shell->term, info.involuntary);
+                terminal_putc(shell->term, '\n');
+            }
+        }
+    } else if (strcmp(args[0], "top") == 0) {
+        // The first screen covers everything since boot; later ones the
+        // last second.
+        if (top_state.owner && top_state.owner != shell) top_state.owner->top_active = 0;
+        top_state.owner = shell;
+        top_state.sample_ns = 0;
+        memset(top_state.cpu_busy_ns, 0, sizeof(top_state.cpu_busy_ns));
+        memset(top_state.cpu_idle_ns, 0, sizeof(top_state.cpu_idle_ns));
+        if (top_state.task_ns) memset(top_state.task_ns, 0, top_state.task_slots * sizeof(u64));
+        shell->top_active = 1;
+        top_render(shell);
+    } else if (strcmp(args[0], "ps") == 0) {
+        for (u32 cpu = 0; cpu < task_cpu_count(); cpu++) {
+            task_cpu_stats_t st;
+            if (task_cpu_stats(cpu, &st) != 0 || !st.online) continue;
+            terminal_print(shell->term, "cpu");
+            print_dec(shell->term, cpu);
+            terminal_putc(shell->term, ' ');
+            print_pct(shell->term, st.busy_ns, st.busy_ns + st.idle_ns);
+            terminal_print(shell->term, " busy since boot, ");
+            print_dec(shell->term, st.busy_ns / 1000000);
+            terminal_print(shell->term, " ms busy, ");
+            print_dec(shell->term, st.idle_ns / 1000000);
+            terminal_print(shell->term, " ms idle\n");
+        }
+        terminal_print(shell->term, "    ID   CPU ms  WAIT ms SWITCHES CPU CLASS       STATE    NAME\n");
+        for (u32 i = 0; i < task_slots(); i++) {
+            task_info_t info;
+            if (task_info(i, &info) != 0 || info.idle) continue;
+            print_task_row(shell->term, i, &info);
+        }
+    } else if (strcmp(args[0], "irqstat") == 0) {
+        if (argc >= 2 && strcmp(args[1], "reset") == 0) {
+            irqstat_reset();
+            irqtrace_reset();
+            terminal_print(shell->term, "Interrupt statistics cleared\n");
+        } else if (argc >= 2 && strcmp(args[1], "trace") == 0) {
+            if (argc >= 3 && strcmp(args[2], "on") == 0) {
+                irqtrace_reset();
+                irqtrace_set_enabled(true);
+                terminal_print(shell->term, "irqs-off tracer on\n");
+            } else if (argc >= 3 && strcmp(args[2], "off") == 0) {
+                irqtrace_set_enabled(false);
+                terminal_print(shell->term, "irqs-off tracer off\n");
+            } else {
+                terminal_print(shell->term, "Usage: irqstat trace <on|off>\n");
+            }
+        } else if (argc >= 2 && strcmp(args[1], "dump") == 0) {
+            irqtrace_dump_serial();
+            terminal_print(shell->term, "Written to serial\n");
+        } else {
+            terminal_print(shell->term, "Handler time (ns)  count      min      avg      p99      max\n");
+            for (u32 i = 0; i < IRQSTAT_SLOTS; i++) {
+                const histogram_t *h = irqstat_get(i);
+                if (!h->count) continue;
+                const char *name = irqstat_name(i);
+                terminal_print(shell->term, "  ");
+                terminal_print(shell->term, name);
+                for (int pad = (int)strlen(name); pad < 12; pad++) terminal_putc(shell->term, ' ');
+                print_dec_width(shell->term, h->count, 11);
+                print_dec_width(shell->term, h->min, 9);
+                print_dec_width(shell->term, h->sum / h->count, 9);
+                print_dec_width(shell->term, histogram_percentile(h, 99), 9);
+                print_dec_width(shell->term, h->max, 9);
+                terminal_putc(shell->term, '\n');
+            }
+            terminal_print(shell->term, "Deferred work:\n");
+            for (u32 cpu = 0; cpu < task_cpu_count(); cpu++) {
+                softirq_stats_t ss;
+                if (softirq_get_stats(cpu, &ss) != 0) continue;
+                terminal_print(shell->term, "  cpu");
+                print_dec(shell->term, cpu);
+                terminal_print(shell->term, ": softirqs raised ");
+                print_dec(shell->term, ss.raised);
+                terminal_print(shell->term, ", run at irq exit ");
+                print_dec(shell->term, ss.irq_exit_runs);
+                terminal_print(shell->term, ", deferred ");
+                print_dec(shell->term, ss.deferred);
+                terminal_print(shell->term, ", work items ");
+                print_dec(shell->term, ss.work_done);
+                terminal_putc(shell->term, '\n');
+            }
+            irqtrace_record_t recs[IRQTRACE_RECORDS];
+            u32 n = irqtrace_snapshot(recs, IRQTRACE_RECORDS);
+            terminal_print(shell->term, "Longest irqs-off sections (tracer ");
+            terminal_print(shell->term, irqtrace_is_enabled() ? "on" : "off");
+            terminal_print(shell->term, "):\n");
+            for (u32 i = 0; i < n; i++) {
+                terminal_print(shell->term, "  ");
+                print_dec_width(shell->term, recs[i].ns, 9);
+                terminal_print(shell->term, " ns  cpu");
+                print_dec(shell->term, recs[i].cpu);
+                terminal_print(shell->term, "  off ");
+                print_hex(shell->term, recs[i].start_rip);
+                terminal_print(shell->term, " on ");
+                print_hex(shell->term, recs[i].end_rip);
+                terminal_putc(shell->term, '\n');
+            }
+        }
+    } else if (strcmp(args[0], "locks") == 0) {
+        if (argc >= 2 && strcmp(args[1], "reset") == 0) {
+            lock_stats_reset();
+            terminal_print(shell->term, "Lock statistics cleared\n");
+        } else {
+            // Hottest first: by time spent spinning, then by acquisitions.
+            static lock_stats_t rows[LOCK_STATS_MAX];
+            u32 n = 0;
+            for (u32 i = 0; i < lock_stats_count(); i++) {
+                lock_stats_t s;
+                if (lock_stats_get(i, &s) != 0) continue;
+                u32 at = n++;
+                while (at > 0 && (rows[at - 1].spin_cycles < s.spin_cycles ||
+                                  (rows[at - 1].spin_cycles == s.spin_cycles &&
+                                   rows[at - 1].acquisitions < s.acquisitions))) {
+                    rows[at] = rows[at - 1];
+                    at--;
+                }
+                rows[at] = s;
+            }
+            u32 limit = 16;
+            if (argc >= 2) {
+                u32 want = 0;
+                for (char *q = args[1]; *q && want < 1000; q++) if (*q >= '0' && *q <= '9') want = want * 10 + (u32)(*q - '0');
+                if (want > 0) limit = want;
+            }
+            terminal_print(shell->term, "Lock           acquired contended   spin us hold avg ns hold max ns\n");
+            for (u32 i = 0; i < n && i < limit; i++) {
+                const lock_stats_t *s = &rows[i];
+                char label[16];
+                u32 len = 0;
+                while (s->name[len] && len < 11) {
+                    label[len] = s->name[len];
+                    len++;
+                }
+                if (s->instance >= 0 && len < 12) {
+                    label[len++] = '/';
+                    if (s->instance >= 10) label[len++] = (char)('0' + (s->instance / 10) % 10);
+                    label[len++] = (char)('0' + s->instance % 10);
+                }
+                label[len] = 0;
+                terminal_print(shell->term, "  ");
+                terminal_print(shell->term, label);
+                for (int pad = (int)len; pad < 13; pad++) terminal_putc(shell->term, ' ');
+                print_dec_width(shell->term, s->acquisitions, 9);
+                print_dec_width(shell->term, s->contended, 10);
+                print_dec_width(shell->term, clock_tsc_to_ns(s->spin_cycles) / 1000, 10);
+                print_dec_width(shell->term, s->acquisitions ? clock_tsc_to_ns(s->hold_cycles / s->acquisitions) : 0, 12);
+                print_dec_width(shell->term, clock_tsc_to_ns(s->hold_max), 12);
+                terminal_putc(shell->term, '\n');
+            }
+            if (n == 0) terminal_print(shell->term, "  no profiled locks\n");
+        }
+    } else if (strcmp(args[0], "ringbench") == 0) {
+        u64 n = 1000000;
+        if (argc >= 2) {
+            n = 0;
+            for (char *q = args[1]; *q; q++) if (*q >= '0' && *q <= '9') n = n * 10 + (*q - '0');
+        }
+        task_cpu_stats_t st;
+        if (n == 0 || n > 100000000) {
+            terminal_print(shell->term, "Usage: ringbench [1..100000000]\n");
+        } else if (task_cpu_count() < 2 || task_cpu_stats(1, &st) != 0 || !st.online) {
+            terminal_print(shell->term, "Needs a second CPU\n");
+        } else {
+            u32 producers = 1;
+            while (producers < RB_MAX_PRODUCERS && producers + 1 < task_cpu_count() &&
+                   task_cpu_stats(producers + 1, &st) == 0 && st.online) {
+                producers++;
+            }
+            terminal_print(shell->term, "Ring throughput, consumer on cpu0:\n");
+            for (int pass = 0; pass < 3; pass++) {
+                rb_use_mpsc = pass == 2;
+                rb_batch = pass == 0 ? 1 : RB_BATCH;
+                rb_producers = rb_use_mpsc ? producers : 1;
+                rb_per_producer = n / rb_producers;
+                if (rb_per_producer == 0) rb_per_producer = 1;
+                rb_total = rb_per_producer * rb_producers;
+                rb_errors = 0;
+                rb_ns = 0;
+                spsc_init(&rb_spsc, rb_spsc_storage, RB_CAPACITY, sizeof(u64));
+                mpsc_init(&rb_mpsc, rb_mpsc_storage, RB_CAPACITY, sizeof(u64));
+                sem_init(&rb_done, 0);
+                u32 started = 0;
+                if (task_create_affinity("ring-consumer", ring_consumer, NULL, 0) >= 0) {
+                    for (; started < rb_producers; started++) {
+                        if (task_create_affinity("ring-producer", ring_producer,
+                                                 (void *)(uintptr_t)started, (int)started + 1) < 0) {
+                            break;
+                        }
+                    }
+                    // Let the consumer stop after what the started ones send.
+                    if (started < rb_producers) rb_total = rb_per_producer * started;
+                    for (u32 i = 0; i <= started; i++) sem_down(&rb_done);
+                }
+                if (started < rb_producers) {
+                    terminal_print(shell->term, "  Could not start tasks\n");
+                    break;
+                }
+                u64 total = rb_total;
+                terminal_print(shell->term, pass == 0 ? "  spsc, batch 1:  " : pass == 1 ? "  spsc, batch 32: " : "  mpsc, batch 32: ");
+                print_dec_width(shell->term, rb_ns ? total * 1000000000ull / rb_ns : 0, 11);
+                terminal_print(shell->term, " ops/s");
+                if (rb_use_mpsc) {
+                    terminal_print(shell->term, ", ");
+                    print_dec(shell->term, rb_producers);
+                    terminal_print(shell->term, rb_producers == 1 ? " producer" : " producers");
+                }
+                if (rb_errors) {
+                    terminal_print(shell->term, ", ");
+                    print_dec(shell->term, rb_errors);
+                    terminal_print(shell->term, " out of order");
+                }
+                terminal_putc(shell->term, '\n');
+            }
+        }
+    } else if (strcmp(args[0], "latency") == 0) {
+        histogram_t *h = desktop_input_latency();
+        if (argc >= 2 && strcmp(args[1], "reset") == 0) {
+            histogram_reset(h);
+            terminal_print(shell->term, "Latency histogram cleared\n");
+        } else {
+            terminal_print(shell->term, "Input-to-present latency (us): ");
+            print_dec(shell->term, h->count);
+            terminal_print(shell->term, " samples");
+            if (h->count) {
+                terminal_print(shell->term, ", avg ");
+                print_dec(shell->term, h->sum / h->count);
+                terminal_print(shell->term, ", p50 ");
+                print_dec(shell->term, histogram_percentile(h, 50));
+                terminal_print(shell->term, ", p99 ");
+                print_dec(shell->term, histogram_percentile(h, 99));
+                terminal_print(shell->term, ", max ");
+                print_dec(shell->term, h->max);
+            }
+            terminal_putc(shell->term, '\n');
+            for (u32 i = 0; i < HIST_BUCKETS; i++) {
+                if (!h->buckets[i]) continue;
+                terminal_print(shell->term, "  <= ");
+                print_dec(shell->term, histogram_bucket_limit(i));
+                terminal_print(shell->term, ": ");
+                print_dec(shell->term, h->buckets[i]);
+                terminal_putc(shell->term, '\n');
+            }
+        }
     } else if (strcmp(args[0], "color") == 0) {
         if (argc < 2) {
             terminal_print(shell->term, "Usage: color <white|red|green|blue|cyan|yellow|magenta|orange|pink|lime|gray|reset>\n");
@@ -496,7 +1257,29 @@ static void execute_command(shell_t *shell, char *cmd) {
         print_ip(shell->term, net_get_gateway());
         terminal_print(shell->term, "\n  DNS: ");
         print_ip(shell->term, net_get_dns());
-        terminal_putc(shell->term, '\n');
+        e1000_stats_t nic;
+        e1000_get_stats(&nic);
+        terminal_print(shell->term, "\n  RX: ");
+        print_dec(shell->term, nic.rx_packets);
+        terminal_print(shell->term, " frames, ");
+        print_dec(shell->term, nic.irqs);
+        terminal_print(shell->term, " irqs, ");
+        print_dec(shell->term, nic.rx_polls);
+        terminal_print(shell->term, " polls, ");
+        print_dec(shell->term, nic.rx_budget_hits);
+        terminal_print(shell->term, " over budget\n  RX ring: ");
+        print_dec(shell->term, nic.rx_polls ? nic.rx_ring_sum / nic.rx_polls : 0);
+        terminal_print(shell->term, " avg, ");
+        print_dec(shell->term, nic.rx_ring_peak);
+        terminal_print(shell->term, " peak of ");
+        print_dec(shell->term, nic.rx_ring_size);
+        terminal_print(shell->term, "; dropped ");
+        print_dec(shell->term, nic.rx_missed);
+        terminal_print(shell->term, " missed, ");
+        print_dec(shell->term, nic.rx_no_buffer);
+        terminal_print(shell->term, " no buffer, ");
+        print_dec(shell->term, nic.rx_overruns);
+        terminal_print(shell->term, " overruns\n");
     } else if (strcmp(args[0], "ls") == 0 || strcmp(args[0], "dir") == 0) {
         const char *path = NULL;
         fs_sort_mode_t mode = FS_SORT_NAME;
@@ -950,7 +1733,7 @@ static void execute_command(shell_t *shell, char *cmd) {
             u64 secs = 0;
             for (char *q = args[1]; *q; q++) if (*q >= '0' && *q <= '9') secs = secs * 10 + (*q - '0');
             if (secs == 0) secs = 1;
-            cpu_sleep_ticks(secs * PIT_HZ);
+            task_sleep(secs * PIT_HZ);
         }
     } else if (strcmp(args[0], "rand") == 0) {
         static u32 seed = 0x12345678;
@@ -1017,6 +1800,7 @@ void shell_init(shell_t *shell, terminal_t *term) {
     shell->history_count = 0;
     shell->history_index = 0;
     shell->exit_requested = 0;
+    shell->top_active = 0;
     shell->cwd[0] = '/';
     shell->cwd[1] = 0;
     terminal_print(shell->term, "Welcome to Fusion OS\nType 'help' for available commands\n\n");
@@ -1039,6 +1823,13 @@ static void shell_set_command(shell_t *shell, const char *cmd) {
 void shell_handle_key(shell_t *shell, const key_event_t *event) {
     if (!event->pressed) return;
 
+    if (shell->top_active) {
+        shell->top_active = 0;
+        if (top_state.owner == shell) top_state.owner = NULL;
+        shell_prompt(shell);
+        return;
+    }
+
     if (event->ascii == '\t') {
         shell_autocomplete(shell);
         return;
@@ -1078,7 +1869,7 @@ void shell_handle_key(shell_t *shell, const key_event_t *event) {
         if (shell->exit_requested) return;
         shell->cmd_len = 0;
         shell->cmd[0] = 0;
-        shell_prompt(shell);
+        if (!shell->top_active) shell_prompt(shell);
         return;
     }
 
@@ -1092,3 +1883,9 @@ void shell_handle_key(shell_t *shell, const key_event_t *event) {
 int shell_should_exit(const shell_t *shell) {
     return shell->exit_requested;
 }
+
+int shell_tick(shell_t *shell) {
+    if (!shell->top_active || top_state.owner != shell) return 0;
+    top_render(shell);
+    return 1;
+}
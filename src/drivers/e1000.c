@@ -2,9 +2,11 @@
 #include "drivers/pci.h"
 #include "kernel/interrupts.h"
 #include "kernel/memory.h"
+#include "kernel/vmm.h"
 
 #define E1000_VENDOR_ID 0x8086
 #define E1000_DEVICE_ID 0x100E
+#define E1000_MMIO_SIZE 0x20000
 
 #define E1000_REG_CTRL  0x0000
 #define E1000_REG_STATUS 0x0008
@@ -28,6 +30,14 @@
 #define E1000_REG_TDT   0x3818
 #define E1000_REG_RAL0  0x5400
 #define E1000_REG_RAH0  0x5404
+#define E1000_REG_MPC   0x4010
+#define E1000_REG_RNBC  0x40A0
+
+#define E1000_ICR_RXDMT0 (1u << 4)
+#define E1000_ICR_RXO    (1u << 6)
+#define E1000_ICR_RXT0   (1u << 7)
+#define E1000_IMS_DEFAULT 0x1F6u
+#define E1000_IMS_RX     (E1000_ICR_RXDMT0 | E1000_ICR_RXO | E1000_ICR_RXT0)
 
 #define E1000_RCTL_EN   (1u << 1)
 #define E1000_RCTL_SBP  (1u << 2)
@@ -40,7 +50,7 @@
 #define E1000_TCTL_EN   (1u << 1)
 #define E1000_TCTL_PSP  (1u << 3)
 
-#define RX_DESC_COUNT 32
+#define RX_DESC_COUNT 256
 #define TX_DESC_COUNT 32
 #define RX_BUF_SIZE 2048
 #define TX_BUF_SIZE 2048
@@ -74,6 +84,7 @@ typedef struct {
     struct tx_desc *tx_descs;
     u8 *rx_bufs[RX_DESC_COUNT];
     u8 *tx_bufs[TX_DESC_COUNT];
+    u8 *rx_buf_block;
     u64 rx_descs_phys;
     u64 tx_descs_phys;
     u64 rx_buf_phys[RX_DESC_COUNT];
@@ -81,7 +92,12 @@ typedef struct {
     u32 rx_index;
     u32 tx_index;
     volatile int irq_fired;
+    // Set by the interrupt when it masks RX interrupts; the poller keeps
+    // them masked until it finds the ring empty.
+    volatile int rx_scheduled;
+    e1000_stats_t stats;
     e1000_rx_cb rx_cb;
+    e1000_irq_cb irq_cb;
 } e1000_device_t;
 
 static e1000_device_t g_dev;
@@ -129,14 +145,19 @@ static int e1000_init_rx(void) {
     if (!g_dev.rx_descs) return 0;
     memset(g_dev.rx_descs, 0, desc_bytes);
 
+    // One physically contiguous block backs every RX buffer, so two
+    // buffers share each page instead of one buffer per page.
+    u64 block_phys = 0;
+    g_dev.rx_buf_block = (u8 *)phys_alloc((size_t)RX_DESC_COUNT * RX_BUF_SIZE, PAGE_SIZE, &block_phys);
+    if (!g_dev.rx_buf_block) return 0;
     for (u32 i = 0; i < RX_DESC_COUNT; i++) {
-        u64 phys = 0;
-        g_dev.rx_bufs[i] = (u8 *)phys_alloc(RX_BUF_SIZE, 16, &phys);
-        if (!g_dev.rx_bufs[i]) return 0;
+        u64 phys = block_phys + (u64)i * RX_BUF_SIZE;
+        g_dev.rx_bufs[i] = g_dev.rx_buf_block + (size_t)i * RX_BUF_SIZE;
         g_dev.rx_buf_phys[i] = phys;
         g_dev.rx_descs[i].addr = phys;
         g_dev.rx_descs[i].status = 0;
     }
+    g_dev.stats.rx_ring_size = RX_DESC_COUNT;
 
     reg_write(E1000_REG_RDBAL, (u32)(g_dev.rx_descs_phys & 0xFFFFFFFFu));
     reg_write(E1000_REG_RDBAH, (u32)(g_dev.rx_descs_phys >> 32));
@@ -190,11 +211,21 @@ static void e1000_configure_mac(void) {
     reg_write(E1000_REG_RAH0, rah);
 }
 
+// Masks RX interrupts and hands the ring to the poller instead of
+// taking an interrupt per frame; e1000_rx_poll unmasks them again once
+// it has drained the ring.
 static void e1000_irq_handler(int irq, void *ctx) {
     (void)irq;
     e1000_device_t *dev = (e1000_device_t *)ctx;
-    reg_read(E1000_REG_ICR);
-    dev->irq_fired = 1;
+    u32 icr = reg_read(E1000_REG_ICR);
+    dev->stats.irqs++;
+    if (icr & E1000_ICR_RXO) dev->stats.rx_overruns++;
+    if (icr & E1000_IMS_RX) {
+        reg_write(E1000_REG_IMC, E1000_IMS_RX);
+        dev->rx_scheduled = 1;
+    }
+    if (icr & ~E1000_IMS_RX) dev->irq_fired = 1;
+    if (dev->irq_cb) dev->irq_cb();
 }
 
 int e1000_init(u8 mac_out[6]) {
@@ -216,7 +247,11 @@ int e1000_init(u8 mac_out[6]) {
     }
 
     g_dev.regs_phys = bar0;
-    g_dev.regs = (volatile u32 *)phys_to_virt(bar0);
+    g_dev.regs = (volatile u32 *)vmm_map_mmio(bar0, E1000_MMIO_SIZE, VMM_CACHE_UC);
+    if (!g_dev.regs) {
+        g_ready = 0;
+        return 0;
+    }
 
     e1000_read_mac(g_dev.mac);
     e1000_configure_mac();
@@ -236,7 +271,7 @@ int e1000_init(u8 mac_out[6]) {
 
     interrupts_set_irq_handler(g_dev.irq, e1000_irq_handler, &g_dev);
     interrupts_unmask_irq(g_dev.irq);
-    reg_write(E1000_REG_IMS, 0x1F6u);
+    reg_write(E1000_REG_IMS, E1000_IMS_DEFAULT);
 
     if (mac_out) {
         for (int i = 0; i < 6; i++) mac_out[i] = g_dev.mac[i];
@@ -249,13 +284,40 @@ void e1000_set_rx_callback(e1000_rx_cb cb) {
     g_dev.rx_cb = cb;
 }
 
-void e1000_poll(void) {
-    if (!g_ready) return;
-    if (g_dev.irq_fired) {
-        g_dev.irq_fired = 0;
+void e1000_set_irq_callback(e1000_irq_cb cb) {
+    g_dev.irq_cb = cb;
+}
+
+int e1000_rx_pending(void) {
+    if (!g_ready) return 0;
+    return g_dev.irq_fired || (g_dev.rx_descs[g_dev.rx_index].status & 0x1);
+}
+
+static u32 e1000_rx_ring_used(void) {
+    u32 used = 0;
+    u32 index = g_dev.rx_index;
+    while (used < RX_DESC_COUNT && (g_dev.rx_descs[index].status & 0x1)) {
+        used++;
+        index = (index + 1) % RX_DESC_COUNT;
     }
+    return used;
+}
 
-    while (g_dev.rx_descs[g_dev.rx_index].status & 0x1) {
+// Hands at most budget received frames to the RX callback and returns
+// how many it passed on. Reaching the budget leaves RX interrupts masked
+// and the rest of the ring for the next call; an empty ring re-enables
+// them. Called from task context by the one task that owns the ring.
+int e1000_rx_poll(int budget) {
+    if (!g_ready) return 0;
+    g_dev.irq_fired = 0;
+
+    u32 used = e1000_rx_ring_used();
+    g_dev.stats.rx_polls++;
+    g_dev.stats.rx_ring_sum += used;
+    if (used > g_dev.stats.rx_ring_peak) g_dev.stats.rx_ring_peak = used;
+
+    int done = 0;
+    while (done < budget && (g_dev.rx_descs[g_dev.rx_index].status & 0x1)) {
         struct rx_desc *desc = &g_dev.rx_descs[g_dev.rx_index];
         u16 length = desc->length;
         if (length > 0 && g_dev.rx_cb) {
@@ -264,7 +326,31 @@ void e1000_poll(void) {
         desc->status = 0;
         reg_write(E1000_REG_RDT, g_dev.rx_index);
         g_dev.rx_index = (g_dev.rx_index + 1) % RX_DESC_COUNT;
+        done++;
+    }
+    g_dev.stats.rx_packets += (u64)done;
+
+    if (done == budget) {
+        g_dev.stats.rx_budget_hits++;
+        return done;
+    }
+    // A frame landing after the check above still raises its cause bit,
+    // so unmasking makes the interrupt fire for it.
+    if (g_dev.rx_scheduled) {
+        g_dev.rx_scheduled = 0;
+        reg_write(E1000_REG_IMS, E1000_IMS_RX);
+    }
+    return done;
+}
+
+// MPC and RNBC clear on read, so each call folds them into the totals.
+void e1000_get_stats(e1000_stats_t *out) {
+    if (!out) return;
+    if (g_ready) {
+        g_dev.stats.rx_missed += reg_read(E1000_REG_MPC);
+        g_dev.stats.rx_no_buffer += reg_read(E1000_REG_RNBC);
     }
+    *out = g_dev.stats;
 }
 
 int e1000_send(const void *data, u16 len) {
@@ -1,5 +1,7 @@
 #include "drivers/gfx.h"
 #include "kernel/memory.h"
+#include "kernel/cpu.h"
+#include "kernel/vmm.h"
 
 static u32 *fb_ptr = 0;
 static u32 *draw_ptr = 0;
@@ -8,6 +10,7 @@ static size_t backbuffer_bytes = 0;
 static u64 fb_width = 0;
 static u64 fb_height = 0;
 static u64 fb_pitch = 0;
+static u64 present_cycles = 0;
 
 static const u8 font[128][16] = {
     [' '] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
@@ -256,7 +259,35 @@ u64 gfx_pitch(void) {
 void gfx_present(void) {
     if (!backbuffer || !fb_ptr || backbuffer_bytes == 0) return;
     if (draw_ptr == fb_ptr) return;
+    u64 start = rdtsc();
     memcpy(fb_ptr, backbuffer, backbuffer_bytes);
+    present_cycles = rdtsc() - start;
+}
+
+u64 gfx_present_cycles(void) {
+    return present_cycles;
+}
+
+void gfx_map_write_combining(void) {
+    if (!fb_ptr) return;
+    u64 virt = (u64)fb_ptr & ~(u64)(PAGE_SIZE - 1);
+    u64 phys = vmm_translate(virt);
+    if (!phys) return;
+    u64 size = (u64)fb_ptr + fb_pitch * fb_height - virt;
+    vmm_map(virt, phys, size, VMM_WRITE | VMM_CACHE_WC);
+}
+
+const char *gfx_memory_type(void) {
+    int type = fb_ptr ? vmm_cache_type((u64)fb_ptr) : -1;
+    switch (type) {
+        case VMM_CACHE_WB: return "WB";
+        case VMM_CACHE_WT: return "WT";
+        case VMM_CACHE_UC_MINUS: return "UC-";
+        case VMM_CACHE_UC: return "UC";
+        case VMM_CACHE_WC: return "WC";
+        case VMM_CACHE_WP: return "WP";
+        default: return "Firmware";
+    }
 }
 
 void gfx_present_rect(int x, int y, int w, int h) {
@@ -1,20 +1,43 @@
 #include "drivers/input.h"
 #include "kernel/cpu.h"
+#include "kernel/clock.h"
+#include "kernel/wait.h"
+#include "kernel/softirq.h"
+#include "kernel/spinlock.h"
+#include "kernel/ring.h"
 
 #define KBD_BUFFER_SIZE 128
 #define MOUSE_BUFFER_SIZE 256
+#define KEY_EVENT_BUFFER_SIZE 64
+#define MOUSE_EVENT_BUFFER_SIZE 128
 
-static volatile u8 scancode_buf[KBD_BUFFER_SIZE];
-static volatile u8 scancode_head = 0;
-static volatile u8 scancode_tail = 0;
+static u8 scancode_buf[KBD_BUFFER_SIZE];
+static spsc_ring_t scancode_ring;
 
-static volatile u8 mouse_buf[MOUSE_BUFFER_SIZE];
-static volatile u8 mouse_head = 0;
-static volatile u8 mouse_tail = 0;
+static u8 mouse_buf[MOUSE_BUFFER_SIZE];
+static spsc_ring_t mouse_ring;
+
+// The interrupt handlers only queue raw bytes above; SOFTIRQ_INPUT
+// decodes them into these event rings, which the desktop reads. The
+// decoder is the single producer because it runs under decode_lock.
+static key_event_t key_events[KEY_EVENT_BUFFER_SIZE];
+static spsc_ring_t key_event_ring;
+
+static mouse_event_t mouse_events[MOUSE_EVENT_BUFFER_SIZE];
+static spsc_ring_t mouse_event_ring;
+
+static spinlock_t decode_lock;
 
 static int mouse_x = 0;
 static int mouse_y = 0;
 static u8 mouse_buttons = 0;
+static u8 mouse_packet[3];
+static int mouse_packet_index = 0;
+
+// Arrival time of the oldest input the desktop has not taken yet, for
+// input-to-present latency.
+static volatile u64 input_arrival_ns = 0;
+static wait_queue_t input_wait_queue;
 
 static int extended = 0;
 static int shift_down = 0;
@@ -73,43 +96,42 @@ static const char scancode_ascii_shift[128] = {
     '*', 0, ' '
 };
 
-static void push_scancode(u8 scancode) {
-    u8 next = (u8)(scancode_head + 1) % KBD_BUFFER_SIZE;
-    if (next == scancode_tail) return;
-    scancode_buf[scancode_head] = scancode;
-    scancode_head = next;
+// Called from the keyboard and mouse interrupts. A full ring drops the
+// byte, as the controller would.
+void input_handle_scancode(u8 scancode) {
+    if (!input_arrival_ns) __sync_bool_compare_and_swap(&input_arrival_ns, 0, clock_monotonic_ns());
+    spsc_push(&scancode_ring, &scancode);
+    softirq_raise(SOFTIRQ_INPUT);
 }
 
-static int pop_scancode(u8 *scancode) {
-    if (scancode_tail == scancode_head) return 0;
-    *scancode = scancode_buf[scancode_tail];
-    scancode_tail = (u8)(scancode_tail + 1) % KBD_BUFFER_SIZE;
-    return 1;
+void input_handle_mouse_byte(u8 data) {
+    if (!input_arrival_ns) __sync_bool_compare_and_swap(&input_arrival_ns, 0, clock_monotonic_ns());
+    spsc_push(&mouse_ring, &data);
+    softirq_raise(SOFTIRQ_INPUT);
 }
 
-static void push_mouse_byte(u8 data) {
-    u8 next = (u8)(mouse_head + 1) % MOUSE_BUFFER_SIZE;
-    if (next == mouse_tail) return;
-    mouse_buf[mouse_head] = data;
-    mouse_head = next;
+static int input_pending(void) {
+    return spsc_count(&key_event_ring) || spsc_count(&mouse_event_ring);
 }
 
-static int pop_mouse_byte(u8 *data) {
-    if (mouse_tail == mouse_head) return 0;
-    *data = mouse_buf[mouse_tail];
-    mouse_tail = (u8)(mouse_tail + 1) % MOUSE_BUFFER_SIZE;
-    return 1;
+int input_wait(u64 timeout) {
+    return wait_event_timeout(input_wait_queue, input_pending(), timeout);
 }
 
-void input_handle_scancode(u8 scancode) {
-    push_scancode(scancode);
+u64 input_take_arrival_ns(void) {
+    return __sync_lock_test_and_set(&input_arrival_ns, 0);
 }
 
-void input_handle_mouse_byte(u8 data) {
-    push_mouse_byte(data);
-}
+static void input_softirq(void);
 
 void input_init(void) {
+    spsc_init(&scancode_ring, scancode_buf, KBD_BUFFER_SIZE, sizeof(u8));
+    spsc_init(&mouse_ring, mouse_buf, MOUSE_BUFFER_SIZE, sizeof(u8));
+    spsc_init(&key_event_ring, key_events, KEY_EVENT_BUFFER_SIZE, sizeof(key_event_t));
+    spsc_init(&mouse_event_ring, mouse_events, MOUSE_EVENT_BUFFER_SIZE, sizeof(mouse_event_t));
+    wait_queue_init(&input_wait_queue);
+    spin_lock_profile(&decode_lock, "input", -1);
+    softirq_register(SOFTIRQ_INPUT, input_softirq);
     mouse_x = 20;
     mouse_y = 20;
     mouse_buttons = 0;
@@ -197,61 +219,59 @@ static key_event_t translate_scancode(u8 scancode) {
     return event;
 }
 
-int input_poll_key(key_event_t *event) {
-    u8 scancode;
-    while (pop_scancode(&scancode)) {
-        key_event_t translated = translate_scancode(scancode);
-        if (translated.pressed || translated.ascii || translated.keycode != KEY_NONE) {
-            *event = translated;
-            return 1;
-        }
-    }
-    return 0;
+// Returns true once a whole packet has been queued as an event.
+static bool decode_mouse_byte(u8 data) {
+    if (mouse_packet_index == 0 && !(data & 0x08)) return false;
+    mouse_packet[mouse_packet_index++] = data;
+    if (mouse_packet_index < 3) return false;
+    mouse_packet_index = 0;
+    int dx = (int)(int8_t)mouse_packet[1];
+    int dy = (int)(int8_t)mouse_packet[2];
+    mouse_buttons = mouse_packet[0] & 0x07;
+
+    mouse_x += dx;
+    mouse_y -= dy;
+    if (mouse_x < 0) mouse_x = 0;
+    if (mouse_y < 0) mouse_y = 0;
+
+    mouse_event_t event;
+    event.x = mouse_x;
+    event.y = mouse_y;
+    event.dx = dx;
+    event.dy = dy;
+    event.buttons = mouse_buttons;
+    return spsc_push(&mouse_event_ring, &event);
 }
 
-static int mouse_read(u8 *data) {
-    u8 status = inb(0x64);
-    if (!(status & 0x01)) return 0;
-    if (!(status & 0x20)) return 0;
-    *data = inb(0x60);
-    return 1;
+// SOFTIRQ_INPUT: turns the raw bytes into events right after the
+// interrupt and wakes the desktop only once there is a whole event.
+static void input_softirq(void) {
+    u8 bytes[32];
+    u32 n;
+    spin_lock(&decode_lock);
+    bool produced = false;
+    while ((n = spsc_dequeue(&scancode_ring, bytes, sizeof(bytes))) != 0) {
+        for (u32 i = 0; i < n; i++) {
+            key_event_t event = translate_scancode(bytes[i]);
+            if (!event.pressed && !event.ascii && event.keycode == KEY_NONE) continue;
+            if (spsc_push(&key_event_ring, &event)) produced = true;
+        }
+    }
+    while ((n = spsc_dequeue(&mouse_ring, bytes, sizeof(bytes))) != 0) {
+        for (u32 i = 0; i < n; i++) {
+            if (decode_mouse_byte(bytes[i])) produced = true;
+        }
+    }
+    spin_unlock(&decode_lock);
+    if (produced) wake_up(&input_wait_queue);
 }
 
-static int mouse_get_byte(u8 *data) {
-    if (pop_mouse_byte(data)) return 1;
-    return mouse_read(data);
+int input_poll_key(key_event_t *event) {
+    return spsc_pop(&key_event_ring, event);
 }
 
 int input_poll_mouse(mouse_event_t *event) {
-    static u8 packet[3];
-    static int packet_index = 0;
-
-    u8 data;
-    while (mouse_get_byte(&data)) {
-        if (packet_index == 0 && !(data & 0x08)) {
-            continue;
-        }
-        packet[packet_index++] = data;
-        if (packet_index == 3) {
-            packet_index = 0;
-            int dx = (int)(int8_t)packet[1];
-            int dy = (int)(int8_t)packet[2];
-            mouse_buttons = packet[0] & 0x07;
-
-            mouse_x += dx;
-            mouse_y -= dy;
-            if (mouse_x < 0) mouse_x = 0;
-            if (mouse_y < 0) mouse_y = 0;
-
-            event->x = mouse_x;
-            event->y = mouse_y;
-            event->dx = dx;
-            event->dy = dy;
-            event->buttons = mouse_buttons;
-            return 1;
-        }
-    }
-    return 0;
+    return spsc_pop(&mouse_event_ring, event);
 }
 
 int input_is_shift_down(void) {
@@ -0,0 +1,112 @@
+#include "kernel/clock.h"
+#include "kernel/cpu.h"
+
+#define MSR_TSC_ADJUST 0x3B
+
+#define PIT_INPUT_HZ       1193182u
+#define PIT_CALIBRATE_MS   50u
+#define PIT_CALIBRATE_RUNS 3
+
+static u64 tsc_hz = 0;
+static u64 tsc_base = 0;
+// ns = (tsc delta * ns_mult) >> 32, tsc = (ns * tsc_mult) >> 24.
+static u64 ns_mult = 0;
+static u64 tsc_mult = 0;
+static bool tsc_invariant = false;
+static bool tsc_adjust = false;
+static u64 tsc_adjust_bsp = 0;
+static clock_source_t source = CLOCK_SOURCE_NONE;
+
+// Leaf 0x15 gives the exact TSC/crystal ratio on CPUs that fill it in.
+static u64 tsc_hz_from_cpuid(void) {
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x15) return 0;
+    cpu_cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+    if (eax == 0 || ebx == 0 || ecx == 0) return 0;
+    return (u64)ecx * ebx / eax;
+}
+
+// Times a PIT channel 2 one-shot by polling its output bit, so it works
+// before interrupts are set up and leaves channel 0 alone.
+static u64 tsc_hz_from_pit(void) {
+    u32 latch = PIT_INPUT_HZ / (1000u / PIT_CALIBRATE_MS);
+    u64 best = 0;
+    for (int run = 0; run < PIT_CALIBRATE_RUNS; run++) {
+        outb(0x61, (u8)((inb(0x61) & ~0x02) | 0x01));
+        outb(0x43, 0xB0);
+        outb(0x42, (u8)(latch & 0xFF));
+        outb(0x42, (u8)(latch >> 8));
+        u64 start = rdtsc();
+        while ((inb(0x61) & 0x20) == 0) asm volatile("pause");
+        u64 cycles = rdtsc() - start;
+        // The shortest run saw the least interference.
+        if (best == 0 || cycles < best) best = cycles;
+    }
+    return best * (1000u / PIT_CALIBRATE_MS);
+}
+
+void clock_init(void) {
+    u32 eax, ebx, ecx, edx;
+    tsc_invariant = cpu_tsc_invariant();
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        tsc_adjust = (ebx & (1u << 1)) != 0;
+    }
+    if (tsc_adjust) tsc_adjust_bsp = rdmsr(MSR_TSC_ADJUST);
+
+    tsc_hz = tsc_hz_from_cpuid();
+    source = CLOCK_SOURCE_CPUID;
+    if (tsc_hz == 0) {
+        tsc_hz = tsc_hz_from_pit();
+        source = CLOCK_SOURCE_PIT;
+    }
+    if (tsc_hz == 0) {
+        source = CLOCK_SOURCE_NONE;
+        return;
+    }
+    ns_mult = (NSEC_PER_SEC << 32) / tsc_hz;
+    tsc_mult = (tsc_hz << 24) / NSEC_PER_SEC;
+    tsc_base = rdtsc();
+}
+
+// Firmware may leave per-core TSC_ADJUST values apart; matching the BSP's
+// keeps one clock valid on every CPU.
+void clock_init_ap(void) {
+    if (tsc_adjust && rdmsr(MSR_TSC_ADJUST) != tsc_adjust_bsp) {
+        wrmsr(MSR_TSC_ADJUST, tsc_adjust_bsp);
+    }
+}
+
+u64 clock_monotonic_ns(void) {
+    if (!ns_mult) return ticks * (NSEC_PER_SEC / PIT_HZ);
+    u64 delta = rdtsc() - tsc_base;
+    return (u64)(((unsigned __int128)delta * ns_mult) >> 32);
+}
+
+u64 clock_tsc_hz(void) {
+    return tsc_hz;
+}
+
+// Without a calibrated TSC the cycle count is returned unchanged.
+u64 clock_tsc_to_ns(u64 cycles) {
+    if (!ns_mult) return cycles;
+    return (u64)(((unsigned __int128)cycles * ns_mult) >> 32);
+}
+
+u64 clock_ns_to_tsc(u64 ns) {
+    return (u64)(((unsigned __int128)ns * tsc_mult) >> 24);
+}
+
+bool clock_tsc_invariant(void) {
+    return tsc_invariant;
+}
+
+const char *clock_source_name(void) {
+    switch (source) {
+        case CLOCK_SOURCE_CPUID: return "TSC (CPUID 0x15)";
+        case CLOCK_SOURCE_PIT: return "TSC (PIT calibrated)";
+        default: return "PIT ticks";
+    }
+}
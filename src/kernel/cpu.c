@@ -10,6 +10,11 @@ void pit_init(u32 frequency) {
     outb(0x40, (divisor >> 8) & 0xFF);
 }
 
+// Parks channel 0: mode 0 with no count written never raises IRQ0.
+void pit_stop(void) {
+    outb(0x43, 0x30);
+}
+
 void timer_handler(void) {
     ticks++;
     if (ticks % PIT_HZ == 0) {
@@ -17,6 +22,12 @@ void timer_handler(void) {
     }
 }
 
+// Credits ticks that passed while the PIT was stopped.
+void timer_advance(u64 elapsed) {
+    ticks += elapsed;
+    uptime_seconds = ticks / PIT_HZ;
+}
+
 void cpu_sleep_ticks(u64 sleep_ticks) {
     u64 target = ticks + sleep_ticks;
     while (ticks < target) {
@@ -51,6 +62,20 @@ void cpu_get_features(u32 *features_edx, u32 *features_ecx) {
     asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(*features_ecx), "=d"(*features_edx) : "a"(1));
 }
 
+void cpu_cpuid(u32 leaf, u32 subleaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+bool cpu_tsc_invariant(void) {
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000000u, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007u) return false;
+    cpu_cpuid(0x80000007u, 0, &eax, &ebx, &ecx, &edx);
+    return (edx & (1u << 8)) != 0;
+}
+
 void reboot(void) {
     u8 temp;
     asm volatile("cli");
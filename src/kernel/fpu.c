@@ -0,0 +1,242 @@
+#include "kernel/fpu.h"
+#include "kernel/cpu.h"
+#include "kernel/task.h"
+#include "kernel/memory.h"
+#include "kernel/percpu.h"
+
+#define CR0_MP (1ull << 1)
+#define CR0_EM (1ull << 2)
+#define CR0_TS (1ull << 3)
+#define CR0_NE (1ull << 5)
+
+#define CR4_OSFXSR     (1ull << 9)
+#define CR4_OSXMMEXCPT (1ull << 10)
+#define CR4_OSXSAVE    (1ull << 18)
+
+#define XCR0_X87 (1ull << 0)
+#define XCR0_SSE (1ull << 1)
+#define XCR0_AVX (1ull << 2)
+
+#define FPU_AREA_ALIGN 64
+#define FXSAVE_SIZE 512
+
+#define MXCSR_DEFAULT 0x1F80
+#define FCW_DEFAULT   0x037F
+
+bool fpu_sse2 = false;
+bool fpu_avx2 = false;
+bool fpu_xsave = false;
+u32 fpu_area_size = FXSAVE_SIZE;
+u64 fpu_traps = 0;
+u64 fpu_saves = 0;
+u64 fpu_restores = 0;
+
+static bool fpu_avx = false;
+static bool fpu_xsaveopt = false;
+// Each CPU's percpu fpu_owner is the state currently loaded in its
+// registers. It only counts as live while the owner's last_cpu still
+// names that CPU.
+
+static void fpu_enable(void) {
+    u64 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+
+    u64 cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_xsave) cr4 |= CR4_OSXSAVE;
+    else cr4 &= ~CR4_OSXSAVE;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    if (fpu_xsave) {
+        u64 xcr0 = XCR0_X87 | XCR0_SSE;
+        if (fpu_avx) xcr0 |= XCR0_AVX;
+        asm volatile("xsetbv" : : "c"(0), "a"((u32)xcr0), "d"((u32)(xcr0 >> 32)));
+    }
+    asm volatile("fninit");
+}
+
+static bool fpu_ts_set(void) {
+    u64 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return (cr0 & CR0_TS) != 0;
+}
+
+static void fpu_stts(void) {
+    u64 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    if (!(cr0 & CR0_TS)) asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS));
+}
+
+static void fpu_clts(void) {
+    asm volatile("clts");
+}
+
+static void fpu_save(fpu_state_t *state) {
+    if (fpu_xsave) {
+        if (fpu_xsaveopt) {
+            asm volatile("xsaveopt64 (%0)" : : "r"(state->area), "a"(~0u), "d"(~0u) : "memory");
+        } else {
+            asm volatile("xsave64 (%0)" : : "r"(state->area), "a"(~0u), "d"(~0u) : "memory");
+        }
+    } else {
+        asm volatile("fxsave64 (%0)" : : "r"(state->area) : "memory");
+    }
+    fpu_saves++;
+}
+
+static void fpu_restore(fpu_state_t *state) {
+    if (fpu_xsave) {
+        asm volatile("xrstor64 (%0)" : : "r"(state->area), "a"(~0u), "d"(~0u) : "memory");
+    } else {
+        asm volatile("fxrstor64 (%0)" : : "r"(state->area) : "memory");
+    }
+    fpu_restores++;
+}
+
+void fpu_init(void) {
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    u32 max_leaf = eax;
+
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    fpu_sse2 = (edx & (1u << 26)) != 0;
+    fpu_xsave = (ecx & (1u << 26)) != 0;
+    fpu_avx = fpu_xsave && (ecx & (1u << 28)) != 0;
+    if (fpu_avx && max_leaf >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        fpu_avx2 = (ebx & (1u << 5)) != 0;
+    }
+
+    // Settle on XSAVE before CR4 and XCR0 are programmed, so they never
+    // enable state the save path cannot hold. ECX of sub-leaf 0 sizes the
+    // area for every feature the CPU supports, which bounds what we enable;
+    // anything short of the legacy area plus the XSAVE header is bogus.
+    if (fpu_xsave && max_leaf >= 0xD) {
+        cpu_cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        if (ecx >= FXSAVE_SIZE + 64) {
+            fpu_area_size = ecx;
+            cpu_cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+            fpu_xsaveopt = (eax & 1u) != 0;
+        } else {
+            fpu_xsave = false;
+        }
+    } else {
+        fpu_xsave = false;
+    }
+    if (!fpu_xsave) {
+        fpu_avx = false;
+        fpu_avx2 = false;
+    }
+    fpu_enable();
+
+    if (fpu_xsave) {
+        // EBX now sizes the area for just the features enabled in XCR0.
+        cpu_cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx >= FXSAVE_SIZE + 64 && ebx < fpu_area_size) fpu_area_size = ebx;
+    }
+}
+
+void fpu_init_ap(void) {
+    fpu_enable();
+}
+
+int fpu_state_init(fpu_state_t *state) {
+    u32 size = (fpu_area_size + FPU_AREA_ALIGN - 1) & ~(FPU_AREA_ALIGN - 1);
+    u8 *raw = (u8 *)malloc(size + FPU_AREA_ALIGN - 1);
+    if (!raw) return -1;
+    state->alloc = raw;
+    state->area = (u8 *)(((uintptr_t)raw + FPU_AREA_ALIGN - 1) & ~(uintptr_t)(FPU_AREA_ALIGN - 1));
+    fpu_state_reset(state);
+    return 0;
+}
+
+// Puts an existing area back to the power-on state for a new owner.
+void fpu_state_reset(fpu_state_t *state) {
+    u32 size = (fpu_area_size + FPU_AREA_ALIGN - 1) & ~(FPU_AREA_ALIGN - 1);
+    u8 *area = (u8 *)state->area;
+    memset(area, 0, size);
+    // An all-zero XSAVE header restores the init state; the legacy area
+    // still supplies the control words, so give them the reset values.
+    *(u16 *)(area + 0) = FCW_DEFAULT;
+    *(u32 *)(area + 24) = MXCSR_DEFAULT;
+    state->last_cpu = -1;
+}
+
+void fpu_state_free(fpu_state_t *state) {
+    if (state->alloc) free(state->alloc);
+    state->alloc = NULL;
+    state->area = NULL;
+    state->last_cpu = -1;
+}
+
+// Called by the scheduler with interrupts off before it switches away from
+// prev. Only a task that touched SIMD during this slice has TS clear, so
+// everyone else switches without a save. The saved copy lets the task
+// resume on any CPU, and if it comes back here untouched the registers are
+// reused without a restore.
+void fpu_switch(fpu_state_t *prev) {
+    if (prev && this_cpu()->fpu_owner == prev && prev->area && !fpu_ts_set()) {
+        fpu_save(prev);
+    }
+    fpu_stts();
+}
+
+// #NM: the current task touched SIMD with TS set.
+void fpu_handle_nm(void) {
+    percpu_t *pcpu = this_cpu();
+    int cpu = (int)pcpu->index;
+    fpu_clts();
+    fpu_traps++;
+    fpu_state_t *state = task_current_fpu();
+    if (!state || !state->area) {
+        pcpu->fpu_owner = NULL;
+        return;
+    }
+    if (pcpu->fpu_owner != state || state->last_cpu != cpu) {
+        fpu_restore(state);
+    }
+    pcpu->fpu_owner = state;
+    state->last_cpu = cpu;
+}
+
+// A preemptible task needs nothing here: its first SIMD instruction traps
+// into fpu_handle_nm and the scheduler saves the registers if it is
+// switched out. With interrupts off the section may have interrupted the
+// owner mid-use, so its registers are saved and ownership dropped; the
+// owner's next SIMD instruction traps and restores them.
+void kernel_fpu_begin(void) {
+    u64 flags = irq_save();
+    if ((flags & (1ull << 9)) && task_current_fpu()) {
+        irq_restore(flags);
+        return;
+    }
+    percpu_t *pcpu = this_cpu();
+    if (pcpu->fpu_depth++ == 0) {
+        pcpu->fpu_flags = flags;
+        fpu_state_t *owner = pcpu->fpu_owner;
+        if (owner && owner->area && owner->last_cpu == (int)pcpu->index && !fpu_ts_set()) {
+            fpu_save(owner);
+        }
+        pcpu->fpu_owner = NULL;
+        fpu_clts();
+    }
+}
+
+void kernel_fpu_end(void) {
+    u64 flags = irq_save();
+    percpu_t *pcpu = this_cpu();
+    if (pcpu->fpu_depth == 0) {
+        irq_restore(flags);
+        return;
+    }
+    if (--pcpu->fpu_depth == 0) {
+        fpu_stts();
+        irq_restore(pcpu->fpu_flags);
+        return;
+    }
+    irq_restore(flags);
+}
@@ -0,0 +1,54 @@
+#include "kernel/histogram.h"
+#include "kernel/memory.h"
+
+static u32 histogram_bucket(u64 value) {
+    u32 bucket = value ? 63 - (u32)__builtin_clzll(value) : 0;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+void histogram_record(histogram_t *h, u64 value) {
+    h->buckets[histogram_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if (h->count == 1 || value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void histogram_record_atomic(histogram_t *h, u64 value) {
+    __atomic_fetch_add(&h->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    u64 cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value < cur &&
+           !__atomic_compare_exchange_n(&h->min, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(&h->max, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+void histogram_reset(histogram_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = ~0ull;
+}
+
+u64 histogram_bucket_limit(u32 bucket) {
+    if (bucket >= HIST_BUCKETS - 1) return ~0ull;
+    return (2ull << bucket) - 1;
+}
+
+u64 histogram_percentile(const histogram_t *h, u32 pct) {
+    if (h->count == 0) return 0;
+    u64 rank = (h->count * pct + 99) / 100;
+    if (rank == 0) rank = 1;
+    u64 seen = 0;
+    for (u32 i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            u64 limit = histogram_bucket_limit(i);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
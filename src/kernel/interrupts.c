@@ -5,6 +5,11 @@
 #include "kernel/memory.h"
 #include "kernel/lapic.h"
 #include "kernel/task.h"
+#include "kernel/fpu.h"
+#include "kernel/timer.h"
+#include "kernel/percpu.h"
+#include "kernel/irqstat.h"
+#include "kernel/softirq.h"
 #include "services/log.h"
 #include "drivers/serial.h"
 
@@ -43,7 +48,6 @@ static struct idt_entry idt[IDT_SIZE];
 static u16 code_selector = 0x08;
 static irq_handler_t irq_handlers[16];
 static void *irq_contexts[16];
-static volatile u64 irq_counts[16];
 static void (*vector_handlers[IDT_SIZE])(void);
 
 static void serial_write_hex(u64 value) {
@@ -131,13 +135,16 @@ static void pic_send_eoi(int irq) {
 }
 
 static void irq_dispatch(int irq) {
+    u64 start = rdtsc();
     if (irq >= 0 && irq < 16) {
-        irq_counts[irq]++;
+        this_cpu()->irq_counts[irq]++;
         if (irq_handlers[irq]) {
             irq_handlers[irq](irq, irq_contexts[irq]);
         }
     }
     pic_send_eoi(irq);
+    irqstat_record((u32)irq, start);
+    softirq_irq_exit();
 }
 
 __attribute__((interrupt))
@@ -165,7 +172,7 @@ __attribute__((interrupt)) static void isr_ex_3(struct interrupt_frame *frame) {
 __attribute__((interrupt)) static void isr_ex_4(struct interrupt_frame *frame) { exception_noerr(4, frame); }
 __attribute__((interrupt)) static void isr_ex_5(struct interrupt_frame *frame) { exception_noerr(5, frame); }
 __attribute__((interrupt)) static void isr_ex_6(struct interrupt_frame *frame) { exception_noerr(6, frame); }
-__attribute__((interrupt)) static void isr_ex_7(struct interrupt_frame *frame) { exception_noerr(7, frame); }
+__attribute__((interrupt)) static void isr_ex_7(struct interrupt_frame *frame) { (void)frame; fpu_handle_nm(); }
 __attribute__((interrupt)) static void isr_ex_8(struct interrupt_frame *frame, u64 error) { exception_err(8, frame, error); }
 __attribute__((interrupt)) static void isr_ex_9(struct interrupt_frame *frame) { exception_noerr(9, frame); }
 __attribute__((interrupt)) static void isr_ex_10(struct interrupt_frame *frame, u64 error) { exception_err(10, frame, error); }
@@ -221,28 +228,37 @@ static void isr_irq15(struct interrupt_frame *frame) { (void)frame; irq_dispatch
 __attribute__((interrupt))
 static void isr_timer(struct interrupt_frame *frame) {
     (void)frame;
+    u64 start = rdtsc();
     timer_handler();
-    task_tick();
-    irq_counts[0]++;
+    timer_run(ticks);
+    this_cpu()->irq_counts[0]++;
     pic_send_eoi(0);
+    irqstat_record(0, start);
+    softirq_irq_exit();
 }
 
 __attribute__((interrupt))
 static void isr_keyboard(struct interrupt_frame *frame) {
     (void)frame;
+    u64 start = rdtsc();
     u8 scancode = inb(0x60);
-    irq_counts[1]++;
+    this_cpu()->irq_counts[1]++;
     input_handle_scancode(scancode);
     pic_send_eoi(1);
+    irqstat_record(1, start);
+    softirq_irq_exit();
 }
 
 __attribute__((interrupt))
 static void isr_mouse(struct interrupt_frame *frame) {
     (void)frame;
+    u64 start = rdtsc();
     u8 data = inb(0x60);
-    irq_counts[12]++;
+    this_cpu()->irq_counts[12]++;
     input_handle_mouse_byte(data);
     pic_send_eoi(12);
+    irqstat_record(12, start);
+    softirq_irq_exit();
 }
 
 __attribute__((naked))
@@ -288,6 +304,7 @@ static void isr_vector_0xf0(void) {
         "1:\n"
         "movq %r12, %rsp\n"
         "2:\n"
+        "call task_finish_switch\n"
         "popq %r15\n"
         "popq %r14\n"
         "popq %r13\n"
@@ -361,6 +378,7 @@ static void interrupts_setup_idt(void) {
 }
 
 void interrupts_init(void) {
+    irqstat_init();
     interrupts_setup_idt();
     pic_remap();
 
@@ -400,7 +418,9 @@ void interrupts_mask_irq(int irq) {
 
 u64 interrupts_get_irq_count(int irq) {
     if (irq < 0 || irq >= 16) return 0;
-    return irq_counts[irq];
+    u64 total = 0;
+    for (u32 cpu = 0; cpu < PERCPU_MAX; cpu++) total += percpu_areas[cpu].irq_counts[irq];
+    return total;
 }
 
 void interrupts_set_vector(int vector, void (*handler)(void)) {
@@ -0,0 +1,168 @@
+#include "kernel/irqstat.h"
+#include "kernel/cpu.h"
+#include "kernel/clock.h"
+#include "kernel/percpu.h"
+#include "kernel/spinlock.h"
+#include "drivers/serial.h"
+
+static histogram_t irq_hist[IRQSTAT_SLOTS];
+
+static const char *const irq_names[IRQSTAT_SLOTS] = {
+    "pit", "keyboard", "irq2", "irq3", "irq4", "irq5", "irq6", "irq7",
+    "irq8", "irq9", "irq10", "irq11", "mouse", "irq13", "irq14", "irq15",
+    "lapic/sched"
+};
+
+volatile bool irqtrace_enabled = false;
+static irqtrace_record_t trace_records[IRQTRACE_RECORDS];
+static u32 trace_count = 0;
+// Shortest kept record once the table is full; shorter sections skip
+// the lock.
+static volatile u64 trace_floor_ns = 0;
+static spinlock_t trace_lock;
+
+void irqstat_init(void) {
+    irqstat_reset();
+}
+
+void irqstat_record(u32 slot, u64 start_tsc) {
+    if (slot >= IRQSTAT_SLOTS) return;
+    histogram_record_atomic(&irq_hist[slot], clock_tsc_to_ns(rdtsc() - start_tsc));
+}
+
+const histogram_t *irqstat_get(u32 slot) {
+    return slot < IRQSTAT_SLOTS ? &irq_hist[slot] : 0;
+}
+
+const char *irqstat_name(u32 slot) {
+    return slot < IRQSTAT_SLOTS ? irq_names[slot] : "?";
+}
+
+void irqstat_reset(void) {
+    for (u32 i = 0; i < IRQSTAT_SLOTS; i++) histogram_reset(&irq_hist[i]);
+}
+
+// Called from irq_save with interrupts already off. Only the outermost
+// save gets here, since nested ones find IF clear.
+void irqtrace_off(u64 rip) {
+    percpu_t *pcpu = this_cpu();
+    pcpu->irqoff_rip = rip;
+    pcpu->irqoff_tsc = rdtsc();
+}
+
+// Called from irq_restore just before the sti.
+void irqtrace_on(u64 rip) {
+    percpu_t *pcpu = this_cpu();
+    u64 start = pcpu->irqoff_tsc;
+    if (!start) return;
+    pcpu->irqoff_tsc = 0;
+    u64 ns = clock_tsc_to_ns(rdtsc() - start);
+    if (ns <= trace_floor_ns) return;
+
+    spin_lock(&trace_lock);
+    u32 pos = trace_count < IRQTRACE_RECORDS ? trace_count++ : IRQTRACE_RECORDS - 1;
+    if (pos == IRQTRACE_RECORDS - 1 && trace_records[pos].ns >= ns) {
+        spin_unlock(&trace_lock);
+        return;
+    }
+    while (pos > 0 && trace_records[pos - 1].ns < ns) {
+        trace_records[pos] = trace_records[pos - 1];
+        pos--;
+    }
+    trace_records[pos].ns = ns;
+    trace_records[pos].start_rip = pcpu->irqoff_rip;
+    trace_records[pos].end_rip = rip;
+    trace_records[pos].cpu = pcpu->index;
+    if (trace_count == IRQTRACE_RECORDS) trace_floor_ns = trace_records[IRQTRACE_RECORDS - 1].ns;
+    spin_unlock(&trace_lock);
+}
+
+void irqtrace_set_enabled(bool on) {
+    // Drop stale start stamps so the first sections are not measured
+    // from before the tracer was switched on.
+    for (u32 cpu = 0; cpu < PERCPU_MAX; cpu++) percpu_areas[cpu].irqoff_tsc = 0;
+    irqtrace_enabled = on;
+}
+
+bool irqtrace_is_enabled(void) {
+    return irqtrace_enabled;
+}
+
+void irqtrace_reset(void) {
+    u64 flags = irq_save();
+    spin_lock(&trace_lock);
+    trace_count = 0;
+    trace_floor_ns = 0;
+    spin_unlock(&trace_lock);
+    irq_restore(flags);
+}
+
+u32 irqtrace_snapshot(irqtrace_record_t *out, u32 max) {
+    u64 flags = irq_save();
+    spin_lock(&trace_lock);
+    u32 n = trace_count < max ? trace_count : max;
+    for (u32 i = 0; i < n; i++) out[i] = trace_records[i];
+    spin_unlock(&trace_lock);
+    irq_restore(flags);
+    return n;
+}
+
+static void serial_write_dec(u64 value) {
+    char buf[21];
+    int i = 20;
+    buf[i] = 0;
+    do {
+        buf[--i] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    serial_write_str(&buf[i]);
+}
+
+static void serial_write_hex(u64 value) {
+    char buf[19];
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < 16; i++) {
+        u8 nibble = (u8)((value >> ((15 - i) * 4)) & 0xF);
+        buf[2 + i] = (nibble < 10) ? (char)('0' + nibble) : (char)('a' + (nibble - 10));
+    }
+    buf[18] = 0;
+    serial_write_str(buf);
+}
+
+// Writes the handler histograms and the irqs-off records to the serial
+// port; addresses resolve against the kernel ELF (addr2line -e kernel).
+void irqtrace_dump_serial(void) {
+    serial_write_str("[IRQSTAT] handler ns: name count min avg p99 max\n");
+    for (u32 i = 0; i < IRQSTAT_SLOTS; i++) {
+        const histogram_t *h = &irq_hist[i];
+        if (!h->count) continue;
+        serial_write_str("  ");
+        serial_write_str(irq_names[i]);
+        serial_write_char(' ');
+        serial_write_dec(h->count);
+        serial_write_char(' ');
+        serial_write_dec(h->min);
+        serial_write_char(' ');
+        serial_write_dec(h->sum / h->count);
+        serial_write_char(' ');
+        serial_write_dec(histogram_percentile(h, 99));
+        serial_write_char(' ');
+        serial_write_dec(h->max);
+        serial_write_char('\n');
+    }
+    irqtrace_record_t recs[IRQTRACE_RECORDS];
+    u32 n = irqtrace_snapshot(recs, IRQTRACE_RECORDS);
+    serial_write_str("[IRQSTAT] longest irqs-off sections: ns cpu off-rip on-rip\n");
+    for (u32 i = 0; i < n; i++) {
+        serial_write_str("  ");
+        serial_write_dec(recs[i].ns);
+        serial_write_str(" cpu");
+        serial_write_dec(recs[i].cpu);
+        serial_write_char(' ');
+        serial_write_hex(recs[i].start_rip);
+        serial_write_char(' ');
+        serial_write_hex(recs[i].end_rip);
+        serial_write_char('\n');
+    }
+}
@@ -0,0 +1,81 @@
+#include "kernel/kstack.h"
+#include "kernel/memory.h"
+#include "kernel/vmm.h"
+#include "kernel/spinlock.h"
+
+// PML4 slot 509, clear of the direct map and the kernel image.
+#define KSTACK_REGION_BASE 0xFFFFFE8000000000ull
+#define KSTACK_GUARD       PAGE_SIZE
+#define KSTACK_SLOT        (KSTACK_SIZE + KSTACK_GUARD)
+#define KSTACK_MAX_SLOTS   65536u
+
+typedef struct kstack_free {
+    struct kstack_free *next;
+} kstack_free_t;
+
+kstack_stats_t kstack_stats;
+
+static spinlock_t kstack_lock;
+static kstack_free_t *kstack_free_list = NULL;
+static u32 kstack_next_slot = 0;
+static bool kstack_unguarded = false;
+
+// Maps a fresh slot: the guard page stays unmapped, the stack gets one
+// physically contiguous block. Without paging control (or once the region
+// is used up) the block is used straight from the direct map, unguarded.
+// This may run on any CPU, but TLB flushes are local only: a slot must
+// never be unmapped or remapped without adding a cross-CPU shootdown.
+static void *kstack_map_new(void) {
+    u64 phys;
+    void *block = page_alloc(page_order_for(KSTACK_SIZE), &phys);
+    if (!block) return NULL;
+    page_set_owner(block, PAGE_OWNER_KSTACK);
+
+    u64 flags = spin_lock_irqsave(&kstack_lock);
+    u32 slot = kstack_next_slot;
+    bool guarded = !kstack_unguarded && slot < KSTACK_MAX_SLOTS;
+    if (guarded) kstack_next_slot++;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+
+    if (guarded) {
+        u64 virt = KSTACK_REGION_BASE + (u64)slot * KSTACK_SLOT + KSTACK_GUARD;
+        if (vmm_map(virt, phys, KSTACK_SIZE, VMM_WRITE) == 0) {
+            kstack_stats.guarded = true;
+            return (void *)virt;
+        }
+        kstack_unguarded = true;
+    }
+    return block;
+}
+
+void *kstack_alloc(void) {
+    u64 flags = spin_lock_irqsave(&kstack_lock);
+    kstack_free_t *stack = kstack_free_list;
+    if (stack) {
+        kstack_free_list = stack->next;
+        kstack_stats.cached--;
+        kstack_stats.recycled++;
+        kstack_stats.in_use++;
+    }
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    if (stack) return stack;
+
+    void *fresh = kstack_map_new();
+    if (!fresh) return NULL;
+    flags = spin_lock_irqsave(&kstack_lock);
+    kstack_stats.slots++;
+    kstack_stats.in_use++;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    return fresh;
+}
+
+void kstack_free(void *stack) {
+    if (!stack) return;
+    kstack_free_t *entry = (kstack_free_t *)stack;
+    u64 flags = spin_lock_irqsave(&kstack_lock);
+    entry->next = kstack_free_list;
+    kstack_free_list = entry;
+    kstack_stats.cached++;
+    kstack_stats.in_use--;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
@@ -1,23 +1,32 @@
 #include "kernel/lapic.h"
 #include "kernel/cpu.h"
 #include "kernel/memory.h"
+#include "kernel/vmm.h"
+#include "kernel/clock.h"
 
 #define MSR_APIC_BASE 0x1B
+#define MSR_TSC_DEADLINE 0x6E0
 #define APIC_ENABLE   (1ull << 11)
 
 #define LAPIC_REG_ID        0x020
 #define LAPIC_REG_EOI       0x0B0
 #define LAPIC_REG_SVR       0x0F0
 #define LAPIC_REG_TPR       0x080
+#define LAPIC_REG_ICR_LO    0x300
+#define LAPIC_REG_ICR_HI    0x310
+#define LAPIC_ICR_PENDING   (1u << 12)
 #define LAPIC_REG_TIMER     0x320
 #define LAPIC_REG_TIMER_ICR 0x380
 #define LAPIC_REG_TIMER_CCR 0x390
 #define LAPIC_REG_TIMER_DCR 0x3E0
 
-#define LAPIC_TIMER_VECTOR  0xF0
+#define LAPIC_TIMER_MASKED   (1u << 16)
+#define LAPIC_TIMER_PERIODIC (1u << 17)
+#define LAPIC_TIMER_DEADLINE (2u << 17)
 
 static volatile u32 *lapic_regs = 0;
 static u32 lapic_tps = 0;
+static bool lapic_deadline = false;
 
 static inline void lapic_write(u32 reg, u32 val) {
     lapic_regs[reg / 4] = val;
@@ -32,7 +41,7 @@ static void lapic_map(void) {
     base |= APIC_ENABLE;
     wrmsr(MSR_APIC_BASE, base);
     u64 phys = base & 0xFFFFF000u;
-    lapic_regs = (volatile u32 *)phys_to_virt(phys);
+    if (!lapic_regs) lapic_regs = (volatile u32 *)vmm_map_mmio(phys, PAGE_SIZE, VMM_CACHE_UC);
 }
 
 u32 lapic_id(void) {
@@ -45,6 +54,15 @@ void lapic_eoi(void) {
     lapic_write(LAPIC_REG_EOI, 0);
 }
 
+void lapic_send_ipi(u32 apic_id, u8 vector) {
+    if (!lapic_regs) return;
+    u64 flags = irq_save();
+    while (lapic_read(LAPIC_REG_ICR_LO) & LAPIC_ICR_PENDING) asm volatile("pause");
+    lapic_write(LAPIC_REG_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LO, vector);
+    irq_restore(flags);
+}
+
 u32 lapic_timer_ticks_per_sec(void) {
     return lapic_tps;
 }
@@ -66,19 +84,61 @@ static void lapic_timer_calibrate(void) {
 }
 
 void lapic_timer_setup(u32 hz) {
-    if (!lapic_regs || hz == 0) return;
+    if (hz == 0) return;
+    lapic_timer_periodic_us(1000000u / hz);
+}
+
+// Arms this CPU's timer to fire LAPIC_TIMER_VECTOR every period_us. The
+// count rate was calibrated on the BSP and is shared by every core.
+void lapic_timer_periodic_us(u32 period_us) {
+    if (!lapic_regs || period_us == 0) return;
+    if (lapic_tps == 0) lapic_timer_calibrate();
+    u64 initial = (u64)lapic_tps * period_us / 1000000u;
+    if (initial == 0) initial = 1;
+    if (initial > 0xFFFFFFFFu) initial = 0xFFFFFFFFu;
+    lapic_write(LAPIC_REG_TIMER_DCR, 0x3);
+    lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_REG_TIMER_ICR, (u32)initial);
+}
+
+// One-shot interrupt after ns nanoseconds. TSC-deadline mode is used when
+// the CPU has it, since it needs no divide and never drifts from the TSC.
+void lapic_timer_oneshot_ns(u64 ns) {
+    if (!lapic_regs) return;
     if (lapic_tps == 0) lapic_timer_calibrate();
-    u32 initial = lapic_tps / hz;
+    if (ns == 0) ns = 1;
+    if (lapic_deadline && clock_tsc_hz()) {
+        lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_DEADLINE);
+        asm volatile("mfence" : : : "memory");
+        wrmsr(MSR_TSC_DEADLINE, rdtsc() + clock_ns_to_tsc(ns));
+        return;
+    }
+    u64 initial = (u64)lapic_tps * ns / NSEC_PER_SEC;
     if (initial == 0) initial = 1;
+    if (initial > 0xFFFFFFFFu) initial = 0xFFFFFFFFu;
     lapic_write(LAPIC_REG_TIMER_DCR, 0x3);
     lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_VECTOR);
-    lapic_write(LAPIC_REG_TIMER_ICR, initial);
+    lapic_write(LAPIC_REG_TIMER_ICR, (u32)initial);
+}
+
+void lapic_timer_stop(void) {
+    if (!lapic_regs) return;
+    lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_MASKED);
+    lapic_write(LAPIC_REG_TIMER_ICR, 0);
+    if (lapic_deadline) wrmsr(MSR_TSC_DEADLINE, 0);
+}
+
+bool lapic_timer_has_deadline(void) {
+    return lapic_deadline;
 }
 
 void lapic_init(void) {
     lapic_map();
     lapic_write(LAPIC_REG_TPR, 0);
     lapic_write(LAPIC_REG_SVR, 0x100 | 0xFF);
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    lapic_deadline = (ecx & (1u << 24)) != 0;
     lapic_timer_calibrate();
 }
 
@@ -12,6 +12,11 @@
 #include "services/fs.h"
 #include "kernel/lapic.h"
 #include "kernel/task.h"
+#include "kernel/vmm.h"
+#include "kernel/fpu.h"
+#include "kernel/clock.h"
+#include "kernel/percpu.h"
+#include "kernel/softirq.h"
 #include "services/log.h"
 
 extern u8 __kernel_end[];
@@ -74,11 +79,23 @@ static void desktop_task(void *arg) {
 static void net_task(void *arg) {
     (void)arg;
     for (;;) {
+        // Woken by a net timer. Received frames are handled on the
+        // kworkers; the once-a-second poll only covers a lost interrupt.
+        net_wait_work(PIT_HZ);
         net_poll();
-        task_sleep(1);
     }
 }
 
+// Index of the BSP in the MP response, which is also its percpu slot.
+static u32 bsp_cpu_index(void) {
+    struct limine_smp_response *mp = mp_request.response;
+    if (!mp) return 0;
+    for (u32 i = 0; i < mp->cpu_count; i++) {
+        if (mp->cpus[i]->lapic_id == mp->bsp_lapic_id) return i;
+    }
+    return 0;
+}
+
 static void ap_entry(struct limine_smp_info *info) {
     u32 index = (u32)info->extra_argument;
     boot_stack_set(index);
@@ -91,6 +108,10 @@ static void ap_entry(struct limine_smp_info *info) {
         :
         : "ax"
     );
+    percpu_init(index);
+    vmm_init_ap();
+    fpu_init_ap();
+    clock_init_ap();
     task_register_cpu(info->lapic_id, index);
     lapic_init_ap();
     interrupts_init_ap();
@@ -98,24 +119,6 @@ static void ap_entry(struct limine_smp_info *info) {
     while (1) asm volatile("hlt");
 }
 
-void pmm_init(void) {
-    if (memmap_request.response == NULL) return;
-
-    struct limine_memmap_response *memmap = memmap_request.response;
-
-    for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *entry = memmap->entries[i];
-        uint64_t pages = entry->length / PAGE_SIZE;
-        pmm_total_pages += pages;
-
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            pmm_free_pages += pages;
-        } else {
-            pmm_used_pages += pages;
-        }
-    }
-}
-
 void _start(void) {
     log_init();
     LOG_INFO("kernel: booting");
@@ -131,11 +134,13 @@ void _start(void) {
 
     u64 kernel_phys_base = 0;
     u64 kernel_phys_end = 0;
+    u64 kernel_virt_base = 0;
     if (kernel_address_request.response != NULL) {
         u64 virt_base = kernel_address_request.response->virtual_base;
         u64 phys_base = kernel_address_request.response->physical_base;
         u64 kernel_end = (u64)__kernel_end;
         kernel_phys_base = phys_base;
+        kernel_virt_base = virt_base;
         if (kernel_end > virt_base) {
             kernel_phys_end = phys_base + (kernel_end - virt_base);
         }
@@ -158,11 +163,17 @@ void _start(void) {
         :
         : "ax"
     );
+    percpu_init(bsp_cpu_index());
 
+    memory_set_memmap(memmap_request.response, kernel_phys_base, kernel_phys_end);
+    pmm_init();
     heap_init();
+    if (kernel_virt_base != 0) vmm_init(kernel_phys_base, kernel_virt_base);
+    gfx_map_write_combining();
+    fpu_init();
+    clock_init();
+    memory_init_dispatch();
     gfx_enable_backbuffer(1);
-    pmm_init();
-    memory_set_memmap(memmap_request.response, kernel_phys_base, kernel_phys_end);
     input_init();
     gfx_clear(0x000000);
     net_init();
@@ -182,7 +193,8 @@ void _start(void) {
     interrupts_unmask_irq(12);
 
     task_init(cpu_count);
-    task_create("desktop", desktop_task, NULL);
+    softirq_init(cpu_count);
+    task_create_class("desktop", desktop_task, NULL, -1, TASK_CLASS_INTERACTIVE);
     task_create("net", net_task, NULL);
 
     if (mp_request.response) {
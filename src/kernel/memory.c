@@ -1,22 +1,86 @@
 #include "kernel/memory.h"
-#include <limine.h>
-
-static u8 heap[HEAP_SIZE];
-static block_t *heap_start = NULL;
+#include "kernel/spinlock.h"
+#include "kernel/task.h"
+#include "kernel/fpu.h"
+#include "kernel/cpu.h"
+
+#define SLAB_MIN_SHIFT 3
+#define SLAB_MAX_SHIFT 12
+#define SLAB_MAX_SIZE (1u << SLAB_MAX_SHIFT)
+#define SLAB_CLASS_COUNT (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_ORDER 4
+#define HEAP_ARENA_ORDER 8
+#define HEAP_DIRECT_MIN (64 * 1024)
+#define MAGAZINE_SIZE 32
+#define HEAP_MAX_CPUS 64
+#define HEAP_BUCKETS 64
+#define BLOCK_ALIGN 16
+// The footer only needs 8 bytes but is padded so payloads stay 16-aligned.
+#define BLOCK_FOOTER 16
+#define BLOCK_OVERHEAD (sizeof(block_t) + BLOCK_FOOTER)
+
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;
+    u8 *bump;
+    u32 class_index;
+    u32 object_size;
+    u32 inuse;
+    u32 capacity;
+} slab_t;
+
+typedef struct {
+    slab_t *partial;
+    u32 object_size;
+} slab_class_t;
+
+typedef struct {
+    u32 count;
+    void *objs[MAGAZINE_SIZE];
+} magazine_t;
+
+typedef struct {
+    magazine_t mags[SLAB_CLASS_COUNT];
+    u64 alloc_bytes;
+    u64 free_bytes;
+    u64 depot_refills;
+    u64 depot_flushes;
+    mcs_node_t lock_node;
+} __attribute__((aligned(64))) heap_cpu_cache_t;
+
+static block_t *heap_buckets[HEAP_BUCKETS];
+static u64 heap_bucket_map = 0;
+static slab_class_t slab_classes[SLAB_CLASS_COUNT];
+static heap_cpu_cache_t cpu_caches[HEAP_MAX_CPUS];
+static mcs_lock_t heap_lock;
+static u64 large_allocated = 0;
+static u64 large_freed = 0;
+static u64 heap_arenas = 0;
 
 u64 heap_allocated = 0;
 u64 heap_freed = 0;
 u64 heap_blocks = 0;
-
-u64 pmm_total_pages = 0;
-u64 pmm_used_pages = 0;
-u64 pmm_free_pages = 0;
+u64 heap_slabs = 0;
+u64 heap_lock_contended = 0;
+u64 heap_depot_refills = 0;
+u64 heap_depot_flushes = 0;
+u64 heap_arena_pages = 0;
+u64 heap_direct_pages = 0;
 
 static u64 hhdm_offset = 0;
-static struct limine_memmap_response *memmap_response = NULL;
-static u64 phys_alloc_base = 0;
-static u64 phys_alloc_end = 0;
-static u64 phys_alloc_next = 0;
+
+// Copies and fills at least this large use non-temporal stores, in chunks of
+// at most MEM_STREAM_CHUNK bytes.
+#define MEM_STREAM_MIN (256 * 1024)
+#define MEM_STREAM_CHUNK (64 * 1024)
+
+static bool mem_erms = false;
+static bool mem_fsrm = false;
+static void (*stream_copy)(u8 *dest, const u8 *src, size_t n) = NULL;
+static void (*stream_fill)(u8 *dest, u64 pattern, size_t n) = NULL;
+static size_t stream_width = 0;
 
 static u64 align_up(u64 value, u64 align) {
     if (align == 0) return value;
@@ -24,18 +88,171 @@ static u64 align_up(u64 value, u64 align) {
     return (value + mask) & ~mask;
 }
 
-static u64 align_down(u64 value, u64 align) {
-    if (align == 0) return value;
-    return value & ~(align - 1);
+static void copy_rep_movsb(void *dest, const void *src, size_t n) {
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void copy_rep_movsq(void *dest, const void *src, size_t n) {
+    size_t tail = n & 7;
+    n >>= 3;
+    asm volatile("rep movsq\n"
+                 "mov %3, %%rcx\n"
+                 "rep movsb"
+                 : "+D"(dest), "+S"(src), "+c"(n)
+                 : "r"(tail)
+                 : "memory");
+}
+
+static void fill_rep_stosb(void *dest, u8 value, size_t n) {
+    asm volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(value) : "memory");
+}
+
+static void fill_rep_stosq(void *dest, u8 value, size_t n) {
+    u64 pattern = 0x0101010101010101ull * value;
+    size_t tail = n & 7;
+    n >>= 3;
+    asm volatile("rep stosq\n"
+                 "mov %3, %%rcx\n"
+                 "rep stosb"
+                 : "+D"(dest), "+c"(n)
+                 : "a"(pattern), "r"(tail)
+                 : "memory");
+}
+
+// Non-temporal loops: n is a multiple of the block size and dest is aligned
+// to the vector width. The kernel is built without SSE, so the compiler
+// never holds anything in the vector registers these clobber.
+static void stream_copy_sse2(u8 *dest, const u8 *src, size_t n) {
+    asm volatile("1:\n"
+                 "movdqu (%1), %%xmm0\n"
+                 "movdqu 16(%1), %%xmm1\n"
+                 "movdqu 32(%1), %%xmm2\n"
+                 "movdqu 48(%1), %%xmm3\n"
+                 "movntdq %%xmm0, (%0)\n"
+                 "movntdq %%xmm1, 16(%0)\n"
+                 "movntdq %%xmm2, 32(%0)\n"
+                 "movntdq %%xmm3, 48(%0)\n"
+                 "add $64, %0\n"
+                 "add $64, %1\n"
+                 "sub $64, %2\n"
+                 "jnz 1b\n"
+                 "sfence"
+                 : "+r"(dest), "+r"(src), "+r"(n)
+                 :
+                 : "memory");
+}
+
+static void stream_copy_avx2(u8 *dest, const u8 *src, size_t n) {
+    asm volatile("1:\n"
+                 "vmovdqu (%1), %%ymm0\n"
+                 "vmovdqu 32(%1), %%ymm1\n"
+                 "vmovdqu 64(%1), %%ymm2\n"
+                 "vmovdqu 96(%1), %%ymm3\n"
+                 "vmovntdq %%ymm0, (%0)\n"
+                 "vmovntdq %%ymm1, 32(%0)\n"
+                 "vmovntdq %%ymm2, 64(%0)\n"
+                 "vmovntdq %%ymm3, 96(%0)\n"
+                 "add $128, %0\n"
+                 "add $128, %1\n"
+                 "sub $128, %2\n"
+                 "jnz 1b\n"
+                 "sfence\n"
+                 "vzeroupper"
+                 : "+r"(dest), "+r"(src), "+r"(n)
+                 :
+                 : "memory");
+}
+
+static void stream_fill_sse2(u8 *dest, u64 pattern, size_t n) {
+    asm volatile("movq %2, %%xmm0\n"
+                 "punpcklqdq %%xmm0, %%xmm0\n"
+                 "1:\n"
+                 "movntdq %%xmm0, (%0)\n"
+                 "movntdq %%xmm0, 16(%0)\n"
+                 "movntdq %%xmm0, 32(%0)\n"
+                 "movntdq %%xmm0, 48(%0)\n"
+                 "add $64, %0\n"
+                 "sub $64, %1\n"
+                 "jnz 1b\n"
+                 "sfence"
+                 : "+r"(dest), "+r"(n)
+                 : "r"(pattern)
+                 : "memory");
+}
+
+static void stream_fill_avx2(u8 *dest, u64 pattern, size_t n) {
+    asm volatile("vmovq %2, %%xmm0\n"
+                 "vpbroadcastq %%xmm0, %%ymm0\n"
+                 "1:\n"
+                 "vmovntdq %%ymm0, (%0)\n"
+                 "vmovntdq %%ymm0, 32(%0)\n"
+                 "vmovntdq %%ymm0, 64(%0)\n"
+                 "vmovntdq %%ymm0, 96(%0)\n"
+                 "add $128, %0\n"
+                 "sub $128, %1\n"
+                 "jnz 1b\n"
+                 "sfence\n"
+                 "vzeroupper"
+                 : "+r"(dest), "+r"(n)
+                 : "r"(pattern)
+                 : "memory");
+}
+
+// ERMS makes rep movsb the best choice from ~128 bytes up; FSRM extends
+// that to short copies.
+static void copy_small(void *dest, const void *src, size_t n) {
+    if (mem_fsrm || (mem_erms && n >= 128)) copy_rep_movsb(dest, src, n);
+    else copy_rep_movsq(dest, src, n);
 }
 
-static int ranges_overlap(u64 a0, u64 a1, u64 b0, u64 b1) {
-    return a0 < b1 && b0 < a1;
+static void fill_small(void *dest, u8 value, size_t n) {
+    if (mem_erms) fill_rep_stosb(dest, value, n);
+    else fill_rep_stosq(dest, value, n);
+}
+
+void memory_init_dispatch(void) {
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        mem_erms = (ebx & (1u << 9)) != 0;
+        mem_fsrm = (edx & (1u << 4)) != 0;
+    }
+    if (fpu_avx2) {
+        stream_copy = stream_copy_avx2;
+        stream_fill = stream_fill_avx2;
+        stream_width = 128;
+    } else if (fpu_sse2) {
+        stream_copy = stream_copy_sse2;
+        stream_fill = stream_fill_sse2;
+        stream_width = 64;
+    }
+}
+
+const char *memory_copy_impl(void) {
+    if (stream_copy == stream_copy_avx2) return mem_erms ? "erms + avx2-nt" : "movsq + avx2-nt";
+    if (stream_copy == stream_copy_sse2) return mem_erms ? "erms + sse2-nt" : "movsq + sse2-nt";
+    return mem_erms ? "erms" : "movsq";
 }
 
 void *memset(void *s, int c, size_t n) {
-    u8 *p = s;
-    while (n--) *p++ = (u8)c;
+    u8 *d = s;
+    if (n >= MEM_STREAM_MIN && stream_fill) {
+        u64 pattern = 0x0101010101010101ull * (u8)c;
+        size_t head = (size_t)(-(uintptr_t)d & 63);
+        fill_small(d, (u8)c, head);
+        d += head;
+        n -= head;
+        while (n >= stream_width) {
+            size_t chunk = n > MEM_STREAM_CHUNK ? MEM_STREAM_CHUNK : n & ~(size_t)(stream_width - 1);
+            kernel_fpu_begin();
+            stream_fill(d, pattern, chunk);
+            kernel_fpu_end();
+            d += chunk;
+            n -= chunk;
+        }
+    }
+    fill_small(d, (u8)c, n);
     return s;
 }
 
@@ -43,22 +260,26 @@ void *memcpy(void *dest, const void *src, size_t n) {
     u8 *d = dest;
     const u8 *s = src;
     if (n == 0 || d == s) return dest;
-
-    while (n && ((uintptr_t)d & 7)) {
-        *d++ = *s++;
-        n--;
-    }
-
-    u64 *d64 = (u64 *)d;
-    const u64 *s64 = (const u64 *)s;
-    while (n >= 8) {
-        *d64++ = *s64++;
-        n -= 8;
+    if (n >= MEM_STREAM_MIN && stream_copy) {
+        // Align the destination to a cache line for the streaming stores.
+        size_t head = (size_t)(-(uintptr_t)d & 63);
+        copy_small(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+        // Chunks bound how long a copy keeps interrupts off when it runs
+        // outside a preemptible task.
+        while (n >= stream_width) {
+            size_t chunk = n > MEM_STREAM_CHUNK ? MEM_STREAM_CHUNK : n & ~(size_t)(stream_width - 1);
+            kernel_fpu_begin();
+            stream_copy(d, s, chunk);
+            kernel_fpu_end();
+            d += chunk;
+            s += chunk;
+            n -= chunk;
+        }
     }
-
-    d = (u8 *)d64;
-    s = (const u8 *)s64;
-    while (n--) *d++ = *s++;
+    copy_small(d, s, n);
     return dest;
 }
 
@@ -66,13 +287,21 @@ void *memmove(void *dest, const void *src, size_t n) {
     u8 *d = dest;
     const u8 *s = src;
     if (d == s || n == 0) return dest;
+    if (d + n <= s || s + n <= d) return memcpy(dest, src, n);
     if (d < s) {
-        while (n--) *d++ = *s++;
-    } else {
-        d += n;
-        s += n;
-        while (n--) *--d = *--s;
+        // A forward string copy is byte-ordered, so it handles this overlap.
+        copy_rep_movsb(d, s, n);
+        return dest;
+    }
+    d += n;
+    s += n;
+    while (n >= 8) {
+        d -= 8;
+        s -= 8;
+        n -= 8;
+        *(u64 *)d = *(const u64 *)s;
     }
+    while (n--) *--d = *--s;
     return dest;
 }
 
@@ -106,14 +335,6 @@ char *strcpy(char *dest, const char *src) {
     return dest;
 }
 
-void heap_init(void) {
-    heap_start = (block_t *)heap;
-    heap_start->size = HEAP_SIZE - sizeof(block_t);
-    heap_start->free = true;
-    heap_start->next = NULL;
-    heap_blocks = 1;
-}
-
 void memory_set_hhdm_offset(u64 offset) {
     hhdm_offset = offset;
 }
@@ -122,113 +343,423 @@ u64 memory_hhdm_offset(void) {
     return hhdm_offset;
 }
 
-void memory_set_memmap(struct limine_memmap_response *memmap,
-                       u64 kernel_phys_base, u64 kernel_phys_end) {
-    memmap_response = memmap;
-    phys_alloc_base = 0;
-    phys_alloc_end = 0;
-    phys_alloc_next = 0;
-    if (!memmap_response) return;
-
-    u64 best_base = 0;
-    u64 best_len = 0;
-
-    for (u64 i = 0; i < memmap_response->entry_count; i++) {
-        struct limine_memmap_entry *entry = memmap_response->entries[i];
-        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
-
-        u64 base = entry->base;
-        u64 end = entry->base + entry->length;
-
-        if (kernel_phys_end > kernel_phys_base &&
-            ranges_overlap(base, end, kernel_phys_base, kernel_phys_end)) {
-            if (kernel_phys_end < end) {
-                base = kernel_phys_end;
-            } else if (kernel_phys_base > base) {
-                end = kernel_phys_base;
-            } else {
-                continue;
-            }
-        }
+void *phys_to_virt(u64 phys) {
+    return (void *)(phys + hhdm_offset);
+}
+
+static u64 *block_footer(block_t *block) {
+    return (u64 *)((u8 *)block + sizeof(block_t) + block->size);
+}
+
+static void block_set_size(block_t *block, size_t size) {
+    block->size = size;
+    *block_footer(block) = size;
+}
+
+static block_t *block_next(block_t *block) {
+    return (block_t *)((u8 *)block_footer(block) + BLOCK_FOOTER);
+}
+
+static block_t *block_prev(block_t *block) {
+    u64 prev_size = *(u64 *)((u8 *)block - BLOCK_FOOTER);
+    return (block_t *)((u8 *)block - BLOCK_FOOTER - prev_size - sizeof(block_t));
+}
+
+static u32 bucket_index(size_t size) {
+    return 63 - (u32)__builtin_clzll((u64)size);
+}
+
+static void bucket_insert(block_t *block) {
+    u32 b = bucket_index(block->size);
+    block->free = true;
+    block->prev = NULL;
+    block->next = heap_buckets[b];
+    if (heap_buckets[b]) heap_buckets[b]->prev = block;
+    heap_buckets[b] = block;
+    heap_bucket_map |= 1ull << b;
+}
 
-        base = align_up(base, PAGE_SIZE);
-        end = align_down(end, PAGE_SIZE);
-        if (end <= base) continue;
+static void bucket_remove(block_t *block) {
+    u32 b = bucket_index(block->size);
+    if (block->prev) block->prev->next = block->next;
+    else heap_buckets[b] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    if (!heap_buckets[b]) heap_bucket_map &= ~(1ull << b);
+    block->free = false;
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+// Lays out [fence][one free block][fence] over a region. The fences are
+// permanently used zero-size blocks, so neighbour merging never has to
+// bounds-check the region.
+static void heap_add_region(u8 *base, size_t length) {
+    block_t *head = (block_t *)base;
+    head->free = false;
+    head->next = NULL;
+    head->prev = NULL;
+    block_set_size(head, 0);
+
+    block_t *block = block_next(head);
+    size_t usable = length - 2 * (sizeof(block_t) + BLOCK_FOOTER) - sizeof(block_t);
+    block_set_size(block, usable & ~(size_t)(BLOCK_ALIGN - 1));
+
+    block_t *tail = block_next(block);
+    tail->size = 0;
+    tail->free = false;
+    tail->next = NULL;
+    tail->prev = NULL;
+
+    bucket_insert(block);
+    heap_blocks++;
+}
+
+// Trims a used block down to size, returning the tail to the free lists.
+static void block_split(block_t *block, size_t size) {
+    if (block->size < size + BLOCK_OVERHEAD + BLOCK_ALIGN) return;
+    size_t rest = block->size - size - BLOCK_OVERHEAD;
+    block_set_size(block, size);
+    block_t *tail = block_next(block);
+    block_set_size(tail, rest);
+    heap_blocks++;
+
+    block_t *next = block_next(tail);
+    if (next->free) {
+        bucket_remove(next);
+        block_set_size(tail, tail->size + BLOCK_OVERHEAD + next->size);
+        heap_blocks--;
+    }
+    bucket_insert(tail);
+}
+
+static size_t block_round(size_t size) {
+    if (size < BLOCK_ALIGN) size = BLOCK_ALIGN;
+    return (size + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1);
+}
+
+static int heap_grow(size_t size) {
+    u32 order = page_order_for(size + 4 * BLOCK_OVERHEAD);
+    if (order < HEAP_ARENA_ORDER) order = HEAP_ARENA_ORDER;
+    u8 *base = page_alloc(order, NULL);
+    if (!base) return 0;
+    page_set_owner(base, PAGE_OWNER_HEAP_ARENA);
+    heap_add_region(base, (size_t)PAGE_SIZE << order);
+    heap_arena_pages += 1ull << order;
+    heap_arenas++;
+    return 1;
+}
+
+// Hands an arena back to the PMM once its only block is free again. The
+// last arena is kept so a burst of alloc/free pairs does not thrash pages.
+static int heap_release(block_t *block) {
+    block_t *head = block_prev(block);
+    if (head->size != 0 || block_next(block)->size != 0) return 0;
+    if (heap_arenas <= 1 || page_owner(head) != PAGE_OWNER_HEAP_ARENA) return 0;
+    heap_arena_pages -= 1ull << page_block_order(head);
+    heap_arenas--;
+    heap_blocks--;
+    page_free(head);
+    return 1;
+}
 
-        u64 len = end - base;
-        if (len > best_len) {
-            best_len = len;
-            best_base = base;
+static void *large_alloc(size_t size) {
+    size = block_round(size);
+
+    // First fit inside the size's own bucket, otherwise the head of the
+    // smallest non-empty bucket above it, which is always big enough.
+    u32 b = bucket_index(size);
+    block_t *found = heap_buckets[b];
+    while (found && found->size < size) found = found->next;
+    if (!found) {
+        u64 above = b >= 63 ? 0 : heap_bucket_map & ~((2ull << b) - 1);
+        if (!above) {
+            if (!heap_grow(size)) return NULL;
+            above = heap_bucket_map & ~((2ull << b) - 1);
         }
+        found = heap_buckets[__builtin_ctzll(above)];
+    }
+
+    bucket_remove(found);
+    block_split(found, size);
+    return (void *)((u8 *)found + sizeof(block_t));
+}
+
+static void large_free(void *ptr) {
+    block_t *block = (block_t *)((u8 *)ptr - sizeof(block_t));
+
+    block_t *next = block_next(block);
+    if (next->free) {
+        bucket_remove(next);
+        block_set_size(block, block->size + BLOCK_OVERHEAD + next->size);
+        heap_blocks--;
     }
+    block_t *prev = block_prev(block);
+    if (prev->free) {
+        bucket_remove(prev);
+        block_set_size(prev, prev->size + BLOCK_OVERHEAD + block->size);
+        heap_blocks--;
+        block = prev;
+    }
+    if (heap_release(block)) return;
+    bucket_insert(block);
+}
+
+static u32 slab_class_index(size_t size) {
+    if (size <= ((size_t)1 << SLAB_MIN_SHIFT)) return 0;
+    return (u32)(64 - __builtin_clzll((u64)(size - 1))) - SLAB_MIN_SHIFT;
+}
+
+static u8 heap_owner(void *ptr) {
+    // Arenas, slabs and direct blocks are all at least SLAB_SIZE-aligned
+    // buddy blocks, so rounding down never leaves the block holding ptr.
+    return page_owner((void *)((u64)ptr & ~(u64)(SLAB_SIZE - 1)));
+}
+
+static slab_t *slab_lookup(void *ptr) {
+    if (heap_owner(ptr) != PAGE_OWNER_HEAP_SLAB) return NULL;
+    return (slab_t *)((u64)ptr & ~(u64)(SLAB_SIZE - 1));
+}
+
+static void slab_list_push(slab_class_t *cls, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = cls->partial;
+    if (cls->partial) cls->partial->prev = slab;
+    cls->partial = slab;
+}
 
-    if (best_len > 0) {
-        phys_alloc_base = best_base;
-        phys_alloc_end = best_base + best_len;
-        phys_alloc_next = phys_alloc_base;
+static void slab_list_remove(slab_class_t *cls, slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else cls->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static slab_t *slab_create(u32 class_index) {
+    // Slabs are SLAB_SIZE-aligned buddy blocks, so the header of any object
+    // is found by masking the object's address.
+    slab_t *slab = page_alloc(SLAB_ORDER, NULL);
+    if (!slab) return NULL;
+    page_set_owner(slab, PAGE_OWNER_HEAP_SLAB);
+
+    u32 object_size = slab_classes[class_index].object_size;
+    u64 first = align_up(sizeof(slab_t), object_size);
+
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free_list = NULL;
+    slab->bump = (u8 *)slab + first;
+    slab->class_index = class_index;
+    slab->object_size = object_size;
+    slab->inuse = 0;
+    slab->capacity = (u32)((SLAB_SIZE - first) / object_size);
+
+    heap_slabs++;
+    return slab;
+}
+
+static void slab_destroy(slab_t *slab) {
+    heap_slabs--;
+    page_free(slab);
+}
+
+static void *slab_alloc(u32 class_index) {
+    slab_class_t *cls = &slab_classes[class_index];
+    slab_t *slab = cls->partial;
+    if (!slab) {
+        slab = slab_create(class_index);
+        if (!slab) return NULL;
+        slab_list_push(cls, slab);
+    }
+
+    void *obj;
+    if (slab->free_list) {
+        obj = slab->free_list;
+        slab->free_list = *(void **)obj;
+    } else {
+        obj = slab->bump;
+        slab->bump += slab->object_size;
+    }
+    slab->inuse++;
+    if (slab->inuse == slab->capacity) {
+        slab_list_remove(cls, slab);
     }
+    return obj;
 }
 
-void *phys_to_virt(u64 phys) {
-    return (void *)(phys + hhdm_offset);
+static void slab_free(slab_t *slab, void *ptr) {
+    slab_class_t *cls = &slab_classes[slab->class_index];
+    int was_full = slab->inuse == slab->capacity;
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->inuse--;
+
+    if (was_full) {
+        slab_list_push(cls, slab);
+    } else if (slab->inuse == 0 && (cls->partial != slab || slab->next)) {
+        // Keep one empty slab per class so alloc/free pairs on an idle
+        // class do not bounce slabs through the page allocator.
+        slab_list_remove(cls, slab);
+        slab_destroy(slab);
+    }
 }
 
-void *phys_alloc(size_t size, size_t align, u64 *out_phys) {
-    if (size == 0 || phys_alloc_end <= phys_alloc_base) return NULL;
-    u64 align_val = align == 0 ? 8 : align;
-    u64 next = align_up(phys_alloc_next, align_val);
-    if (next + size > phys_alloc_end) return NULL;
-    phys_alloc_next = next + size;
-    if (out_phys) *out_phys = next;
-    return phys_to_virt(next);
-}
-
-static void heap_coalesce(void) {
-    block_t *current = heap_start;
-    while (current && current->next) {
-        if (current->free && current->next->free) {
-            current->size += sizeof(block_t) + current->next->size;
-            current->next = current->next->next;
-            heap_blocks--;
-        } else {
-            current = current->next;
-        }
+static u32 magazine_capacity(u32 class_index) {
+    u32 object_size = slab_classes[class_index].object_size;
+    if (object_size <= 256) return MAGAZINE_SIZE;
+    if (object_size <= 1024) return MAGAZINE_SIZE / 2;
+    return MAGAZINE_SIZE / 4;
+}
+
+static heap_cpu_cache_t *heap_cpu_cache(void) {
+    int cpu = task_cpu_index();
+    if (cpu < 0 || cpu >= HEAP_MAX_CPUS) cpu = 0;
+    return &cpu_caches[cpu];
+}
+
+// Always taken with interrupts off and never nested, so each CPU's queue
+// node can live in its cache instead of on every caller's stack.
+static void heap_lock_acquire(void) {
+    mcs_node_t *node = &heap_cpu_cache()->lock_node;
+    if (!mcs_try_lock(&heap_lock, node)) {
+        heap_lock_contended++;
+        mcs_lock(&heap_lock, node);
     }
 }
 
-void *malloc(size_t size) {
-    if (size == 0) return NULL;
-    
-    size = (size + 7) & ~7;
-    
-    block_t *best = NULL;
-    block_t *current = heap_start;
-    while (current) {
-        if (current->free && current->size >= size) {
-            if (!best || current->size < best->size) {
-                best = current;
-                if (current->size == size) break;
-            }
-        }
-        current = current->next;
+static void heap_lock_release(void) {
+    mcs_unlock(&heap_lock, &heap_cpu_cache()->lock_node);
+}
+
+// Called with interrupts disabled. Refills half a magazine from the depot.
+static void magazine_refill(magazine_t *mag, u32 class_index) {
+    u32 want = magazine_capacity(class_index) / 2;
+    heap_lock_acquire();
+    while (mag->count < want) {
+        void *obj = slab_alloc(class_index);
+        if (!obj) break;
+        mag->objs[mag->count++] = obj;
     }
+    heap_lock_release();
+}
 
-    if (best) {
-        if (best->size >= size + sizeof(block_t) + 8) {
-            block_t *new_block = (block_t *)((u8 *)best + sizeof(block_t) + size);
-            new_block->size = best->size - size - sizeof(block_t);
-            new_block->free = true;
-            new_block->next = best->next;
-            best->next = new_block;
-            best->size = size;
-            heap_blocks++;
-        }
-        best->free = false;
-        heap_allocated += best->size;
-        return (void *)((u8 *)best + sizeof(block_t));
+// Called with interrupts disabled. Returns half a magazine to the depot.
+static void magazine_flush(magazine_t *mag) {
+    u32 keep = mag->count / 2;
+    heap_lock_acquire();
+    while (mag->count > keep) {
+        void *obj = mag->objs[--mag->count];
+        slab_free(slab_lookup(obj), obj);
     }
-    
-    return NULL;
+    heap_lock_release();
+}
+
+static void *small_alloc(u32 class_index) {
+    u64 flags = irq_save();
+    heap_cpu_cache_t *cache = heap_cpu_cache();
+    magazine_t *mag = &cache->mags[class_index];
+    if (mag->count == 0) {
+        cache->depot_refills++;
+        magazine_refill(mag, class_index);
+    }
+    void *obj = NULL;
+    if (mag->count > 0) {
+        obj = mag->objs[--mag->count];
+        cache->alloc_bytes += slab_classes[class_index].object_size;
+    }
+    irq_restore(flags);
+    return obj;
+}
+
+static void small_free(slab_t *slab, void *ptr) {
+    u64 flags = irq_save();
+    heap_cpu_cache_t *cache = heap_cpu_cache();
+    magazine_t *mag = &cache->mags[slab->class_index];
+    if (mag->count >= magazine_capacity(slab->class_index)) {
+        cache->depot_flushes++;
+        magazine_flush(mag);
+    }
+    mag->objs[mag->count++] = ptr;
+    cache->free_bytes += slab->object_size;
+    irq_restore(flags);
+}
+
+void heap_init(void) {
+    for (u32 i = 0; i < HEAP_BUCKETS; i++) heap_buckets[i] = NULL;
+    heap_bucket_map = 0;
+    heap_blocks = 0;
+    heap_slabs = 0;
+    heap_arenas = 0;
+    heap_arena_pages = 0;
+    heap_direct_pages = 0;
+    heap_lock.tail = NULL;
+    mcs_lock_profile(&heap_lock, "heap", -1);
+
+    for (u32 i = 0; i < SLAB_CLASS_COUNT; i++) {
+        slab_classes[i].partial = NULL;
+        slab_classes[i].object_size = 1u << (SLAB_MIN_SHIFT + i);
+    }
+    memset(cpu_caches, 0, sizeof(cpu_caches));
+    heap_grow(0);
+}
+
+void heap_update_stats(void) {
+    u64 allocated = 0;
+    u64 freed = 0;
+    u64 refills = 0;
+    u64 flushes = 0;
+    for (u32 i = 0; i < HEAP_MAX_CPUS; i++) {
+        allocated += cpu_caches[i].alloc_bytes;
+        freed += cpu_caches[i].free_bytes;
+        refills += cpu_caches[i].depot_refills;
+        flushes += cpu_caches[i].depot_flushes;
+    }
+    heap_allocated = allocated + large_allocated;
+    heap_freed = freed + large_freed;
+    heap_depot_refills = refills;
+    heap_depot_flushes = flushes;
+}
+
+static void *direct_alloc(size_t size) {
+    u32 order = page_order_for(size);
+    void *ptr = page_alloc(order, NULL);
+    if (!ptr) return NULL;
+    page_set_owner(ptr, PAGE_OWNER_HEAP_DIRECT);
+
+    u64 flags = irq_save();
+    heap_lock_acquire();
+    heap_direct_pages += 1ull << order;
+    large_allocated += (u64)PAGE_SIZE << order;
+    heap_lock_release();
+    irq_restore(flags);
+    return ptr;
+}
+
+static void direct_free(void *ptr) {
+    u32 order = page_block_order(ptr);
+
+    u64 flags = irq_save();
+    heap_lock_acquire();
+    heap_direct_pages -= 1ull << order;
+    large_freed += (u64)PAGE_SIZE << order;
+    heap_lock_release();
+    irq_restore(flags);
+    page_free(ptr);
+}
+
+void *malloc(size_t size) {
+    if (size == 0) return NULL;
+    if (size <= SLAB_MAX_SIZE) return small_alloc(slab_class_index(size));
+    if (size >= HEAP_DIRECT_MIN) return direct_alloc(size);
+
+    u64 flags = irq_save();
+    heap_lock_acquire();
+    void *ptr = large_alloc(size);
+    if (ptr) large_allocated += ((block_t *)((u8 *)ptr - sizeof(block_t)))->size;
+    heap_lock_release();
+    irq_restore(flags);
+    return ptr;
 }
 
 void *calloc(size_t nmemb, size_t size) {
@@ -240,48 +771,48 @@ void *calloc(size_t nmemb, size_t size) {
     return ptr;
 }
 
+static int large_resize(block_t *block, size_t size) {
+    size_t old_size = block->size;
+
+    if (old_size < size) {
+        block_t *next = block_next(block);
+        if (!next->free || old_size + BLOCK_OVERHEAD + next->size < size) return 0;
+        bucket_remove(next);
+        block_set_size(block, old_size + BLOCK_OVERHEAD + next->size);
+        heap_blocks--;
+    }
+    block_split(block, size);
+    if (block->size > old_size) large_allocated += block->size - old_size;
+    else large_freed += old_size - block->size;
+    return 1;
+}
+
 void *realloc(void *ptr, size_t size) {
     if (!ptr) return malloc(size);
     if (size == 0) {
         free(ptr);
         return NULL;
     }
-    size = (size + 7) & ~7;
-    block_t *block = (block_t *)((u8 *)ptr - sizeof(block_t));
-    size_t old_size = block->size;
-
-    if (old_size >= size) {
-        if (old_size >= size + sizeof(block_t) + 8) {
-            block_t *new_block = (block_t *)((u8 *)block + sizeof(block_t) + size);
-            new_block->size = old_size - size - sizeof(block_t);
-            new_block->free = true;
-            new_block->next = block->next;
-            block->next = new_block;
-            block->size = size;
-            heap_blocks++;
-            heap_freed += (old_size - size);
-            heap_coalesce();
-        }
-        return ptr;
-    }
 
-    block_t *next = block->next;
-    if (next && next->free &&
-        old_size + sizeof(block_t) + next->size >= size) {
-        block->size = old_size + sizeof(block_t) + next->size;
-        block->next = next->next;
-        heap_blocks--;
-        if (block->size >= size + sizeof(block_t) + 8) {
-            block_t *split = (block_t *)((u8 *)block + sizeof(block_t) + size);
-            split->size = block->size - size - sizeof(block_t);
-            split->free = true;
-            split->next = block->next;
-            block->next = split;
-            block->size = size;
-            heap_blocks++;
-        }
-        if (size > old_size) heap_allocated += (size - old_size);
-        return (void *)((u8 *)block + sizeof(block_t));
+    size_t old_size;
+    u8 owner = heap_owner(ptr);
+    if (owner == PAGE_OWNER_HEAP_SLAB) {
+        slab_t *slab = slab_lookup(ptr);
+        if (size <= slab->object_size) return ptr;
+        old_size = slab->object_size;
+    } else if (owner == PAGE_OWNER_HEAP_DIRECT) {
+        old_size = (size_t)PAGE_SIZE << page_block_order(ptr);
+        if (size <= old_size) return ptr;
+    } else {
+        block_t *block = (block_t *)((u8 *)ptr - sizeof(block_t));
+        int resized = 0;
+        u64 flags = irq_save();
+        heap_lock_acquire();
+        if (size < HEAP_DIRECT_MIN) resized = large_resize(block, block_round(size));
+        old_size = block->size;
+        heap_lock_release();
+        irq_restore(flags);
+        if (resized) return ptr;
     }
 
     void *new_ptr = malloc(size);
@@ -293,9 +824,21 @@ void *realloc(void *ptr, size_t size) {
 
 void free(void *ptr) {
     if (!ptr) return;
-    
-    block_t *block = (block_t *)((u8 *)ptr - sizeof(block_t));
-    block->free = true;
-    heap_freed += block->size;
-    heap_coalesce();
+
+    u8 owner = heap_owner(ptr);
+    if (owner == PAGE_OWNER_HEAP_SLAB) {
+        small_free(slab_lookup(ptr), ptr);
+        return;
+    }
+    if (owner == PAGE_OWNER_HEAP_DIRECT) {
+        direct_free(ptr);
+        return;
+    }
+
+    u64 flags = irq_save();
+    heap_lock_acquire();
+    large_freed += ((block_t *)((u8 *)ptr - sizeof(block_t)))->size;
+    large_free(ptr);
+    heap_lock_release();
+    irq_restore(flags);
 }
@@ -0,0 +1,13 @@
+#include "kernel/percpu.h"
+#include "kernel/cpu.h"
+
+#define MSR_GS_BASE 0xC0000101
+
+percpu_t percpu_areas[PERCPU_MAX];
+
+void percpu_init(u32 index) {
+    percpu_t *p = percpu_get(index);
+    p->self = p;
+    p->index = index < PERCPU_MAX ? index : 0;
+    wrmsr(MSR_GS_BASE, (u64)(uintptr_t)p);
+}
@@ -0,0 +1,313 @@
+#include "kernel/memory.h"
+#include "kernel/spinlock.h"
+#include <limine.h>
+
+#define FRAME_MANAGED 0x01
+#define FRAME_FREE    0x02
+#define FRAME_HEAD    0x04
+
+typedef struct {
+    u8 flags;
+    u8 order;
+    u8 owner;
+} page_frame_t;
+
+typedef struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+u64 pmm_total_pages = 0;
+u64 pmm_used_pages = 0;
+u64 pmm_free_pages = 0;
+
+static struct limine_memmap_response *memmap_response = NULL;
+static u64 kernel_base = 0;
+static u64 kernel_end = 0;
+
+static page_frame_t *frames = NULL;
+static u64 frame_count = 0;
+static free_block_t *free_lists[PMM_MAX_ORDER + 1];
+static u64 free_counts[PMM_MAX_ORDER + 1];
+static mcs_lock_t pmm_lock;
+
+static u64 align_up(u64 value, u64 align) {
+    if (align == 0) return value;
+    u64 mask = align - 1;
+    return (value + mask) & ~mask;
+}
+
+static u64 align_down(u64 value, u64 align) {
+    if (align == 0) return value;
+    return value & ~(align - 1);
+}
+
+static int ranges_overlap(u64 a0, u64 a1, u64 b0, u64 b1) {
+    return a0 < b1 && b0 < a1;
+}
+
+static free_block_t *frame_block(u64 frame) {
+    return (free_block_t *)phys_to_virt(frame * PAGE_SIZE);
+}
+
+static void free_list_push(u64 frame, u32 order) {
+    free_block_t *block = frame_block(frame);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (free_lists[order]) free_lists[order]->prev = block;
+    free_lists[order] = block;
+    free_counts[order]++;
+    frames[frame].flags = FRAME_MANAGED | FRAME_FREE;
+    frames[frame].order = (u8)order;
+}
+
+static void free_list_remove(u64 frame, u32 order) {
+    free_block_t *block = frame_block(frame);
+    if (block->prev) block->prev->next = block->next;
+    else free_lists[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    free_counts[order]--;
+    frames[frame].flags = FRAME_MANAGED;
+    frames[frame].order = 0;
+}
+
+static u64 virt_to_frame(void *virt) {
+    return ((u64)virt - memory_hhdm_offset()) / PAGE_SIZE;
+}
+
+static void buddy_insert(u64 frame, u32 order) {
+    while (order < PMM_MAX_ORDER) {
+        u64 buddy = frame ^ (1ull << order);
+        if (buddy >= frame_count) break;
+        page_frame_t *b = &frames[buddy];
+        if (!(b->flags & FRAME_FREE) || b->order != order) break;
+        free_list_remove(buddy, order);
+        if (buddy < frame) frame = buddy;
+        order++;
+    }
+    free_list_push(frame, order);
+}
+
+static void pmm_add_range(u64 base, u64 end) {
+    u64 frame = base / PAGE_SIZE;
+    u64 last = end / PAGE_SIZE;
+    for (u64 i = frame; i < last; i++) {
+        frames[i].flags = FRAME_MANAGED;
+        frames[i].order = 0;
+    }
+    while (frame < last) {
+        u32 order = 0;
+        while (order < PMM_MAX_ORDER &&
+               (frame & ((2ull << order) - 1)) == 0 &&
+               frame + (2ull << order) <= last) {
+            order++;
+        }
+        buddy_insert(frame, order);
+        pmm_free_pages += 1ull << order;
+        frame += 1ull << order;
+    }
+}
+
+static int usable_range(struct limine_memmap_entry *entry, u64 *out_base, u64 *out_end) {
+    if (entry->type != LIMINE_MEMMAP_USABLE) return 0;
+
+    u64 base = entry->base;
+    u64 end = entry->base + entry->length;
+
+    // Never hand out the page at physical address zero.
+    if (base < PAGE_SIZE) base = PAGE_SIZE;
+    base = align_up(base, PAGE_SIZE);
+    end = align_down(end, PAGE_SIZE);
+    if (end <= base) return 0;
+    *out_base = base;
+    *out_end = end;
+    return 1;
+}
+
+static void pmm_add_clipped(u64 base, u64 end, const u64 (*exclude)[2], u32 count) {
+    if (end <= base) return;
+    if (count == 0) {
+        pmm_add_range(base, end);
+        return;
+    }
+    u64 ex_base = align_down(exclude[0][0], PAGE_SIZE);
+    u64 ex_end = align_up(exclude[0][1], PAGE_SIZE);
+    if (ex_end <= ex_base || !ranges_overlap(base, end, ex_base, ex_end)) {
+        pmm_add_clipped(base, end, exclude + 1, count - 1);
+        return;
+    }
+    pmm_add_clipped(base, ex_base < end ? ex_base : end, exclude + 1, count - 1);
+    pmm_add_clipped(ex_end > base ? ex_end : base, end, exclude + 1, count - 1);
+}
+
+u64 pmm_phys_top(void) {
+    u64 top = 0;
+    if (!memmap_response) return 0;
+    for (u64 i = 0; i < memmap_response->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap_response->entries[i];
+        if (entry->base + entry->length > top) top = entry->base + entry->length;
+    }
+    return top;
+}
+
+void memory_set_memmap(struct limine_memmap_response *memmap,
+                       u64 kernel_phys_base, u64 kernel_phys_end) {
+    memmap_response = memmap;
+    kernel_base = kernel_phys_base;
+    kernel_end = kernel_phys_end;
+}
+
+void pmm_init(void) {
+    pmm_total_pages = 0;
+    pmm_used_pages = 0;
+    pmm_free_pages = 0;
+    for (u32 i = 0; i <= PMM_MAX_ORDER; i++) {
+        free_lists[i] = NULL;
+        free_counts[i] = 0;
+    }
+    mcs_lock_profile(&pmm_lock, "pmm", -1);
+    if (!memmap_response) return;
+
+    u64 top = 0;
+    for (u64 i = 0; i < memmap_response->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap_response->entries[i];
+        pmm_total_pages += entry->length / PAGE_SIZE;
+        u64 base, end;
+        if (usable_range(entry, &base, &end) && end > top) top = end;
+    }
+    if (top == 0) return;
+
+    // The frame table lives at the start of the first usable range big
+    // enough to hold it; those pages are never handed to the buddy lists.
+    frame_count = top / PAGE_SIZE;
+    u64 table_bytes = align_up(frame_count * sizeof(page_frame_t), PAGE_SIZE);
+    u64 table_phys = 0;
+    for (u64 i = 0; i < memmap_response->entry_count; i++) {
+        u64 base, end;
+        if (!usable_range(memmap_response->entries[i], &base, &end)) continue;
+        if (ranges_overlap(base, base + table_bytes, kernel_base, kernel_end)) {
+            base = align_up(kernel_end, PAGE_SIZE);
+        }
+        if (end > base && end - base >= table_bytes) {
+            table_phys = base;
+            break;
+        }
+    }
+    if (table_phys == 0) {
+        frame_count = 0;
+        return;
+    }
+
+    frames = (page_frame_t *)phys_to_virt(table_phys);
+    memset(frames, 0, (size_t)(frame_count * sizeof(page_frame_t)));
+
+    const u64 exclude[2][2] = {
+        {kernel_base, kernel_end},
+        {table_phys, table_phys + table_bytes}
+    };
+    for (u64 i = 0; i < memmap_response->entry_count; i++) {
+        u64 base, end;
+        if (!usable_range(memmap_response->entries[i], &base, &end)) continue;
+        pmm_add_clipped(base, end, exclude, 2);
+    }
+    pmm_used_pages = pmm_total_pages - pmm_free_pages;
+}
+
+void *page_alloc(u32 order, u64 *out_phys) {
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    mcs_node_t node;
+    u64 flags = mcs_lock_irqsave(&pmm_lock, &node);
+    u32 found = order;
+    while (found <= PMM_MAX_ORDER && !free_lists[found]) found++;
+    if (found > PMM_MAX_ORDER) {
+        mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+        return NULL;
+    }
+
+    u64 frame = virt_to_frame(free_lists[found]);
+    free_list_remove(frame, found);
+    while (found > order) {
+        found--;
+        free_list_push(frame + (1ull << found), found);
+    }
+
+    frames[frame].flags = FRAME_MANAGED | FRAME_HEAD;
+    frames[frame].order = (u8)order;
+    frames[frame].owner = PAGE_OWNER_NONE;
+    pmm_free_pages -= 1ull << order;
+    pmm_used_pages += 1ull << order;
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+    if (out_phys) *out_phys = frame * PAGE_SIZE;
+    return phys_to_virt(frame * PAGE_SIZE);
+}
+
+void page_free(void *ptr) {
+    if (!ptr || !frames) return;
+    u64 frame = virt_to_frame(ptr);
+    if (frame >= frame_count) return;
+
+    mcs_node_t node;
+    u64 flags = mcs_lock_irqsave(&pmm_lock, &node);
+    page_frame_t *f = &frames[frame];
+    if ((f->flags & (FRAME_MANAGED | FRAME_HEAD)) != (FRAME_MANAGED | FRAME_HEAD)) {
+        mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+        return;
+    }
+
+    u32 order = f->order;
+    f->flags = FRAME_MANAGED;
+    f->order = 0;
+    f->owner = PAGE_OWNER_NONE;
+    pmm_free_pages += 1ull << order;
+    pmm_used_pages -= 1ull << order;
+    buddy_insert(frame, order);
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+static page_frame_t *head_frame(void *ptr) {
+    if (!frames || (u64)ptr < memory_hhdm_offset()) return NULL;
+    u64 frame = virt_to_frame(ptr);
+    if (frame >= frame_count) return NULL;
+    page_frame_t *f = &frames[frame];
+    if ((f->flags & (FRAME_MANAGED | FRAME_HEAD)) != (FRAME_MANAGED | FRAME_HEAD)) return NULL;
+    return f;
+}
+
+void page_set_owner(void *ptr, u8 owner) {
+    page_frame_t *f = head_frame(ptr);
+    if (f) f->owner = owner;
+}
+
+u8 page_owner(void *ptr) {
+    page_frame_t *f = head_frame(ptr);
+    return f ? f->owner : PAGE_OWNER_NONE;
+}
+
+u32 page_block_order(void *ptr) {
+    page_frame_t *f = head_frame(ptr);
+    return f ? f->order : 0;
+}
+
+u32 page_order_for(size_t size) {
+    u32 order = 0;
+    while (order < PMM_MAX_ORDER && ((u64)PAGE_SIZE << order) < size) order++;
+    return order;
+}
+
+u64 pmm_free_blocks(u32 order) {
+    if (order > PMM_MAX_ORDER) return 0;
+    return free_counts[order];
+}
+
+void *phys_alloc(size_t size, size_t align, u64 *out_phys) {
+    if (size == 0) return NULL;
+    // Buddy blocks are naturally aligned to their own size.
+    size_t span = size > align ? size : align;
+    return page_alloc(page_order_for(span), out_phys);
+}
+
+void phys_free(void *ptr) {
+    page_free(ptr);
+}
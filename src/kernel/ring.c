@@ -0,0 +1,153 @@
+#include "kernel/ring.h"
+#include "kernel/memory.h"
+
+static bool ring_capacity_ok(u32 capacity) {
+    return capacity >= 2 && capacity <= (1u << 30) && (capacity & (capacity - 1)) == 0;
+}
+
+int spsc_init(spsc_ring_t *r, void *storage, u32 capacity, u32 elem_size) {
+    if (!r || !storage || !elem_size || !ring_capacity_ok(capacity)) return -1;
+    r->buf = (u8 *)storage;
+    r->mask = capacity - 1;
+    r->size = elem_size;
+    spsc_reset(r);
+    return 0;
+}
+
+void spsc_reset(spsc_ring_t *r) {
+    r->head = 0;
+    r->tail_cache = 0;
+    r->tail = 0;
+    r->head_cache = 0;
+}
+
+// Copies n elements starting at index pos, wrapping at the end of buf.
+static void spsc_copy_in(spsc_ring_t *r, u32 pos, const u8 *src, u32 n) {
+    u32 idx = pos & r->mask;
+    u32 first = r->mask + 1 - idx;
+    if (first > n) first = n;
+    memcpy(r->buf + (size_t)idx * r->size, src, (size_t)first * r->size);
+    if (n > first) memcpy(r->buf, src + (size_t)first * r->size, (size_t)(n - first) * r->size);
+}
+
+static void spsc_copy_out(spsc_ring_t *r, u32 pos, u8 *dst, u32 n) {
+    u32 idx = pos & r->mask;
+    u32 first = r->mask + 1 - idx;
+    if (first > n) first = n;
+    memcpy(dst, r->buf + (size_t)idx * r->size, (size_t)first * r->size);
+    if (n > first) memcpy(dst + (size_t)first * r->size, r->buf, (size_t)(n - first) * r->size);
+}
+
+u32 spsc_enqueue(spsc_ring_t *r, const void *items, u32 n) {
+    u32 head = r->head;
+    u32 capacity = r->mask + 1;
+    u32 space = capacity - (head - r->tail_cache);
+    if (space < n) {
+        // Pairs with the consumer's release: its reads of the slots are
+        // done before we overwrite them.
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        space = capacity - (head - r->tail_cache);
+    }
+    if (n > space) n = space;
+    if (n == 0) return 0;
+    spsc_copy_in(r, head, (const u8 *)items, n);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+u32 spsc_dequeue(spsc_ring_t *r, void *items, u32 max) {
+    u32 tail = r->tail;
+    u32 avail = r->head_cache - tail;
+    if (avail < max) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        avail = r->head_cache - tail;
+    }
+    if (max > avail) max = avail;
+    if (max == 0) return 0;
+    spsc_copy_out(r, tail, (u8 *)items, max);
+    __atomic_store_n(&r->tail, tail + max, __ATOMIC_RELEASE);
+    return max;
+}
+
+u32 spsc_count(const spsc_ring_t *r) {
+    u32 tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+int mpsc_init(mpsc_ring_t *r, void *storage, u32 capacity, u32 elem_size) {
+    if (!r || !storage || !elem_size || !ring_capacity_ok(capacity)) return -1;
+    r->slots = (u8 *)storage;
+    r->mask = capacity - 1;
+    r->size = elem_size;
+    r->stride = MPSC_SLOT_STRIDE(elem_size);
+    r->head = 0;
+    r->tail_cache = 0;
+    r->tail = 0;
+    // A slot holds position p's element once its sequence reads p + 1.
+    // Starting every slot at its index means nothing reads as ready.
+    for (u32 i = 0; i < capacity; i++) *(volatile u32 *)(r->slots + (size_t)i * r->stride) = i;
+    return 0;
+}
+
+static volatile u32 *mpsc_seq(mpsc_ring_t *r, u32 pos) {
+    return (volatile u32 *)(r->slots + (size_t)(pos & r->mask) * r->stride);
+}
+
+u32 mpsc_enqueue(mpsc_ring_t *r, const void *items, u32 n) {
+    u32 capacity = r->mask + 1;
+    u32 head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    u32 want = n;
+    for (;;) {
+        // The cache is shared by all producers and passed on with
+        // release/acquire, so whoever reads it also sees the consumer's
+        // reads as finished.
+        u32 tail = __atomic_load_n(&r->tail_cache, __ATOMIC_ACQUIRE);
+        u32 used = head - tail;
+        u32 space = used < capacity ? capacity - used : 0;
+        if (space < want) {
+            tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            // Racy, but tail only grows, so a stale cache just looks full.
+            __atomic_store_n(&r->tail_cache, tail, __ATOMIC_RELEASE);
+            used = head - tail;
+            space = used < capacity ? capacity - used : 0;
+        }
+        n = want < space ? want : space;
+        if (n == 0) return 0;
+        if (__atomic_compare_exchange_n(&r->head, &head, head + n, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    const u8 *src = (const u8 *)items;
+    for (u32 i = 0; i < n; i++) {
+        volatile u32 *seq = mpsc_seq(r, head + i);
+        memcpy((u8 *)seq + 4, src + (size_t)i * r->size, r->size);
+        __atomic_store_n(seq, head + i + 1, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+// Stops at the first slot a producer has reserved but not yet published.
+u32 mpsc_dequeue(mpsc_ring_t *r, void *items, u32 max) {
+    u32 tail = r->tail;
+    u8 *dst = (u8 *)items;
+    u32 n = 0;
+    while (n < max) {
+        volatile u32 *seq = mpsc_seq(r, tail + n);
+        if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) != tail + n + 1) break;
+        memcpy(dst + (size_t)n * r->size, (const u8 *)seq + 4, r->size);
+        n++;
+    }
+    if (n) __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+bool mpsc_ready(const mpsc_ring_t *r) {
+    u32 tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    const volatile u32 *seq = (const volatile u32 *)(r->slots + (size_t)(tail & r->mask) * r->stride);
+    return __atomic_load_n(seq, __ATOMIC_ACQUIRE) == tail + 1;
+}
+
+bool mpsc_empty(const mpsc_ring_t *r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,155 @@
+#include "kernel/softirq.h"
+#include "kernel/cpu.h"
+#include "kernel/percpu.h"
+#include "kernel/spinlock.h"
+#include "kernel/task.h"
+#include "kernel/wait.h"
+
+// Rounds of raised softirqs handled at interrupt exit before the rest is
+// left to the kworker, which bounds how long one interrupt can run.
+#define SOFTIRQ_MAX_ROUNDS 4
+
+typedef struct {
+    spinlock_t lock;
+    work_t *head;
+    work_t *tail;
+    wait_queue_t wait;
+    int task_id;
+    softirq_stats_t stats;
+    char name[12];
+} __attribute__((aligned(64))) kworker_t;
+
+static softirq_handler_t softirq_handlers[SOFTIRQ_COUNT];
+static kworker_t kworkers[PERCPU_MAX];
+static u32 kworker_count = 0;
+
+void softirq_register(softirq_t nr, softirq_handler_t handler) {
+    if ((u32)nr >= SOFTIRQ_COUNT) return;
+    softirq_handlers[nr] = handler;
+}
+
+void softirq_raise(softirq_t nr) {
+    if ((u32)nr >= SOFTIRQ_COUNT) return;
+    percpu_t *pcpu = this_cpu();
+    __atomic_fetch_or(&pcpu->softirq_pending, 1u << nr, __ATOMIC_RELAXED);
+    kworkers[pcpu->index].stats.raised++;
+}
+
+// Runs with interrupts off on the CPU that owns pcpu. Returns true if
+// softirqs were raised again faster than they could be handled.
+static bool softirq_run(percpu_t *pcpu, u32 rounds) {
+    for (u32 round = 0; round < rounds; round++) {
+        u32 pending = __atomic_exchange_n(&pcpu->softirq_pending, 0, __ATOMIC_ACQUIRE);
+        if (!pending) return false;
+        while (pending) {
+            u32 nr = (u32)__builtin_ctz(pending);
+            pending &= pending - 1;
+            if (softirq_handlers[nr]) softirq_handlers[nr]();
+        }
+    }
+    return pcpu->softirq_pending != 0;
+}
+
+void softirq_irq_exit(void) {
+    percpu_t *pcpu = this_cpu();
+    if (!pcpu->softirq_pending) return;
+    kworker_t *kw = &kworkers[pcpu->index];
+    kw->stats.irq_exit_runs++;
+    if (softirq_run(pcpu, SOFTIRQ_MAX_ROUNDS)) {
+        kw->stats.deferred++;
+        wake_up(&kw->wait);
+    }
+}
+
+void work_init(work_t *work, work_fn_t fn) {
+    work->next = 0;
+    work->fn = fn;
+    work->pending = 0;
+}
+
+bool work_queue_on(u32 cpu, work_t *work) {
+    if (cpu >= PERCPU_MAX) return false;
+    if (__sync_lock_test_and_set(&work->pending, 1)) return false;
+    kworker_t *kw = &kworkers[cpu];
+    u64 flags = spin_lock_irqsave(&kw->lock);
+    work->next = 0;
+    if (kw->tail) kw->tail->next = work;
+    else kw->head = work;
+    kw->tail = work;
+    spin_unlock_irqrestore(&kw->lock, flags);
+    wake_up(&kw->wait);
+    return true;
+}
+
+bool work_queue(work_t *work) {
+    u64 flags = irq_save();
+    u32 cpu = this_cpu()->index;
+    irq_restore(flags);
+    return work_queue_on(cpu, work);
+}
+
+static work_t *kworker_pop(kworker_t *kw) {
+    u64 flags = spin_lock_irqsave(&kw->lock);
+    work_t *work = kw->head;
+    if (work) {
+        kw->head = work->next;
+        if (!kw->head) kw->tail = 0;
+        work->next = 0;
+    }
+    spin_unlock_irqrestore(&kw->lock, flags);
+    return work;
+}
+
+// Pinned to its CPU. Handles softirqs that interrupt exit left over, then
+// the queued work, oldest first; a work item may requeue itself and goes
+// to the back of the line.
+static void kworker_task(void *arg) {
+    u32 cpu = (u32)(uintptr_t)arg;
+    kworker_t *kw = &kworkers[cpu];
+    percpu_t *pcpu = percpu_get(cpu);
+    for (;;) {
+        wait_event(kw->wait, kw->head || pcpu->softirq_pending);
+        if (pcpu->softirq_pending) {
+            u64 flags = irq_save();
+            softirq_run(pcpu, 1);
+            irq_restore(flags);
+        }
+        work_t *work;
+        while ((work = kworker_pop(kw)) != 0) {
+            // Cleared first so the handler, or an interrupt while it
+            // runs, can queue it again.
+            __sync_lock_release(&work->pending);
+            work->fn(work);
+            kw->stats.work_done++;
+            if (pcpu->softirq_pending) break;
+        }
+    }
+}
+
+void softirq_init(u32 cpu_count) {
+    if (cpu_count > PERCPU_MAX) cpu_count = PERCPU_MAX;
+    for (u32 cpu = 0; cpu < cpu_count; cpu++) {
+        kworker_t *kw = &kworkers[cpu];
+        wait_queue_init(&kw->wait);
+        spin_lock_profile(&kw->lock, "workqueue", (int)cpu);
+        // "kworker/N"
+        const char *prefix = "kworker/";
+        u32 len = 0;
+        while (prefix[len]) {
+            kw->name[len] = prefix[len];
+            len++;
+        }
+        if (cpu >= 10) kw->name[len++] = (char)('0' + cpu / 10);
+        kw->name[len++] = (char)('0' + cpu % 10);
+        kw->name[len] = 0;
+        kw->task_id = task_create_class(kw->name, kworker_task, (void *)(uintptr_t)cpu,
+                                        (int)cpu, TASK_CLASS_INTERACTIVE);
+    }
+    kworker_count = cpu_count;
+}
+
+int softirq_get_stats(u32 cpu, softirq_stats_t *out) {
+    if (cpu >= kworker_count || !out) return -1;
+    *out = kworkers[cpu].stats;
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "kernel/spinlock.h"
+#include "kernel/memory.h"
+
+static lock_stats_t lock_stats[LOCK_STATS_MAX];
+static volatile u32 lock_stats_used = 0;
+
+// spin_start is the TSC read when the caller found the lock taken, or 0
+// for an uncontended acquisition.
+void lock_stats_acquired(lock_stats_t *s, u64 spin_start) {
+    u64 now = rdtsc();
+    s->acquisitions++;
+    if (spin_start) {
+        s->contended++;
+        s->spin_cycles += now - spin_start;
+    }
+    s->hold_start = now;
+}
+
+void lock_stats_released(lock_stats_t *s) {
+    u64 held = rdtsc() - s->hold_start;
+    s->hold_cycles += held;
+    if (held > s->hold_max) s->hold_max = held;
+}
+
+// Slots are never returned; locks that come and go stay unprofiled.
+lock_stats_t *lock_stats_register(const char *name, int instance) {
+    u32 slot = __atomic_fetch_add(&lock_stats_used, 1, __ATOMIC_RELAXED);
+    if (slot >= LOCK_STATS_MAX) {
+        __atomic_fetch_sub(&lock_stats_used, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    lock_stats_t *s = &lock_stats[slot];
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    s->instance = instance;
+    return s;
+}
+
+u32 lock_stats_count(void) {
+    u32 used = lock_stats_used;
+    return used < LOCK_STATS_MAX ? used : LOCK_STATS_MAX;
+}
+
+// A racy copy: good enough for a report, and it never takes the lock.
+int lock_stats_get(u32 index, lock_stats_t *out) {
+    if (index >= lock_stats_count() || !out) return -1;
+    *out = lock_stats[index];
+    return 0;
+}
+
+void lock_stats_reset(void) {
+    for (u32 i = 0; i < lock_stats_count(); i++) {
+        lock_stats_t *s = &lock_stats[i];
+        s->acquisitions = 0;
+        s->contended = 0;
+        s->spin_cycles = 0;
+        s->hold_cycles = 0;
+        s->hold_max = 0;
+    }
+}
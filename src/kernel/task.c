@@ -2,9 +2,30 @@
 #include "kernel/cpu.h"
 #include "kernel/memory.h"
 #include "kernel/lapic.h"
+#include "kernel/spinlock.h"
+#include "kernel/fpu.h"
+#include "kernel/timer.h"
+#include "kernel/clock.h"
+#include "kernel/percpu.h"
+#include "kernel/kstack.h"
+#include "kernel/irqstat.h"
+#include "kernel/softirq.h"
 
-#define MAX_TASKS 64
-#define TASK_STACK_SIZE (32 * 1024)
+// The task table grows a chunk at a time; task_t addresses never move.
+#define TASK_CHUNK 64
+#define TASK_MAX_CHUNKS 256
+#define MAX_CPUS PERCPU_MAX
+#define TASK_STACK_SIZE KSTACK_SIZE
+#define SCHED_QUANTUM_DEFAULT_US 10000
+#define SCHED_QUANTUM_MIN_US 100
+#define SCHED_QUANTUM_MAX_US 1000000
+#define TICK_NS (NSEC_PER_SEC / PIT_HZ)
+#define HR_MIN_NS 2000
+#define IDLE_POLL_DEFAULT_US 20
+#define IDLE_POLL_MAX_US 10000
+// How many times in a row queued lower-class tasks may be passed over
+// before the oldest of them gets a turn anyway.
+#define SCHED_STARVE_LIMIT 8
 
 typedef struct {
     u64 rsp;
@@ -15,64 +36,137 @@ typedef enum {
     TASK_READY,
     TASK_RUNNING,
     TASK_SLEEPING,
+    TASK_BLOCKING,
+    TASK_BLOCKED,
     TASK_ZOMBIE
 } task_state_t;
 
-typedef struct {
-    task_state_t state;
+typedef struct task {
+    volatile task_state_t state;
+    u32 id;
     task_context_t ctx;
     u64 wake_tick;
+    u64 wake_ns;
+    bool hr_sleep;
     const char *name;
     task_entry_t entry;
     void *arg;
     void *stack;
     int cpu_affinity;
-    int running_cpu;
+    int cpu;
     int is_idle;
+    task_class_t cls;
+    volatile task_class_t cls_req;
+    u64 voluntary;
+    u64 involuntary;
+    // CPU accounting in clock_monotonic_ns units: time spent running and
+    // time spent READY on a run queue, plus when the current stretch of
+    // either began.
+    u64 runtime_ns;
+    u64 wait_ns;
+    u64 exec_start_ns;
+    u64 ready_ns;
+    struct task *next;
+    struct task *free_next;
+    ktimer_t sleep_timer;
+    fpu_state_t fpu;
 } task_t;
 
-typedef struct {
-    volatile int locked;
-} spinlock_t;
-
-static inline void spin_lock(spinlock_t *l) {
-    while (__sync_lock_test_and_set(&l->locked, 1)) {
-        asm volatile("pause");
-    }
-}
+typedef enum {
+    TICK_STOPPED = 0,
+    TICK_PERIODIC,
+    TICK_ONESHOT
+} tick_mode_t;
 
-static inline void spin_unlock(spinlock_t *l) {
-    __sync_lock_release(&l->locked);
-}
+typedef struct {
+    task_t *head;
+    task_t *tail;
+} task_list_t;
 
-static inline int spin_try_lock(spinlock_t *l) {
-    return __sync_lock_test_and_set(&l->locked, 1) == 0;
-}
+// Each CPU owns a FIFO of ready tasks per class and always runs the
+// highest class that has work. A READY task sits on one run queue,
+// a SLEEPING one on the timer wheel or, for sleep_ns, on the sorted
+// hr_sleepers list of the CPU it slept on. A task waiting on a wait queue
+// is BLOCKING while it still runs and BLOCKED once it is off its CPU;
+// task_unblock tells the two apart. The task being switched away
+// from stays off all of them until the switch has left its stack
+// (task_finish_switch), so no other CPU can pick it up while it is still
+// in use. hr_sleepers is only touched by its own CPU with interrupts off.
+// The running task lives in the CPU's percpu area.
+typedef struct runqueue {
+    spinlock_t lock;
+    task_list_t queue[TASK_CLASS_COUNT];
+    volatile u32 nr;
+    volatile u32 nr_class[TASK_CLASS_COUNT];
+    volatile u32 nr_movable;
+    u32 starved;
+    percpu_t *pcpu;
+    task_t *idle;
+    task_t *switched_from;
+    volatile int online;
+    volatile int yielding;
+    u32 quantum_us;
+    tick_mode_t tick_mode;
+    task_t *hr_sleepers;
+    u64 wakeups;
+    u64 wake_second;
+    u32 wake_count;
+    u32 wake_rate;
+    u64 switches;
+    u64 steals;
+    u64 fast_path;
+    u64 kicks;
+    u64 poll_hits;
+    u64 preemptions;
+    u64 busy_ns;
+} __attribute__((aligned(64))) runqueue_t;
 
-static task_t tasks[MAX_TASKS];
+static task_t *task_chunks[TASK_MAX_CHUNKS];
+static u32 task_chunk_count = 0;
+static task_t *task_free_list = 0;
 static u32 task_count = 0;
 static u32 cpu_count_global = 1;
-static task_t *current_task[64];
-static int idle_index[64];
-static int last_pick[64];
-static spinlock_t sched_lock;
+static runqueue_t runqueues[MAX_CPUS];
+static spinlock_t task_lock;
 static volatile int scheduler_active = 0;
-static u32 lapic_map[256];
-static u32 lapic_map_count = 0;
+static volatile u32 sched_quantum_us = SCHED_QUANTUM_DEFAULT_US;
+static volatile u32 idle_poll_us = IDLE_POLL_DEFAULT_US;
+
+// Tickless idle. The timekeeper CPU takes the PIT interrupt that advances
+// ticks and runs the timer wheel; while it idles with no timer due soon,
+// the PIT is parked and a one-shot LAPIC timer covers the next expiry.
+// The TSC clock measures how many ticks passed meanwhile.
+static int timekeeper_cpu = -1;
+static bool nohz_pit = false;
+static volatile bool pit_stopped = false;
+static volatile u64 pit_wake_tick = 0;
+static volatile u64 pit_stop_ns = 0;
+static volatile u64 pit_stop_tick = 0;
+static u64 pit_ns_carry = 0;
 static u16 kernel_cs = 0x28;
 static u16 kernel_ds = 0x30;
 
 static int cpu_index(void) {
-    u32 id = lapic_id();
-    if (lapic_map_count == 0) return 0;
-    if (id < 256) return (int)lapic_map[id];
-    return 0;
+    return (int)this_cpu_read(index);
+}
+
+int task_cpu_index(void) {
+    return cpu_index();
+}
+
+fpu_state_t *task_current_fpu(void) {
+    if (!scheduler_active) return NULL;
+    task_t *t = this_cpu_read(current);
+    return t ? &t->fpu : NULL;
 }
 
 static u64 task_build_stack(void *stack, void (*entry)(void)) {
-    u64 *sp = (u64 *)((uintptr_t)stack + TASK_STACK_SIZE);
-    sp = (u64 *)((uintptr_t)sp & ~0xFULL);
+    u64 top = ((uintptr_t)stack + TASK_STACK_SIZE) & ~0xFULL;
+    u64 *sp = (u64 *)top;
 
+    // A 64-bit iretq always pops SS and RSP as well.
+    *--sp = kernel_ds;    // SS
+    *--sp = top - 8;      // RSP, as if entry had been called
     *--sp = 0x202;        // RFLAGS
     *--sp = kernel_cs;    // CS (kernel code selector)
     *--sp = (u64)entry;   // RIP
@@ -96,6 +190,159 @@ static u64 task_build_stack(void *stack, void (*entry)(void)) {
     return (u64)sp;
 }
 
+static bool task_frame_valid(u64 rsp) {
+    if (!rsp) return false;
+    u64 *frame = (u64 *)rsp;
+    u64 rip = frame[15];
+    u64 cs = frame[16];
+    return cs == kernel_cs && (rip & 0xFFFF800000000000ull) == 0xFFFF800000000000ull;
+}
+
+static void rq_kick(runqueue_t *rq) {
+    rq->kicks++;
+    lapic_send_ipi(rq->pcpu->lapic_id, LAPIC_RESCHED_VECTOR);
+}
+
+// Wakes the idle CPU behind rq after work was queued for it. A CPU still
+// spinning in its poll window sees the queue change by itself, so it
+// needs no IPI. The fence orders the caller's queue update before the
+// idle_polling read; task_idle_poll does the mirror image.
+static void rq_wake_idle(runqueue_t *rq) {
+    asm volatile("mfence" : : : "memory");
+    if (rq->pcpu->idle_polling) {
+        rq->poll_hits++;
+        return;
+    }
+    rq_kick(rq);
+}
+
+// Queue helpers; the caller holds rq->lock.
+static void rq_append(runqueue_t *rq, task_t *t) {
+    task_list_t *list = &rq->queue[t->cls];
+    t->next = 0;
+    if (list->tail) list->tail->next = t;
+    else list->head = t;
+    list->tail = t;
+    rq->nr++;
+    rq->nr_class[t->cls]++;
+    if (t->cpu_affinity < 0) rq->nr_movable++;
+}
+
+static void rq_unlink(runqueue_t *rq, task_t *t, task_t *prev) {
+    task_list_t *list = &rq->queue[t->cls];
+    if (prev) prev->next = t->next;
+    else list->head = t->next;
+    if (list->tail == t) list->tail = prev;
+    t->next = 0;
+    rq->nr--;
+    rq->nr_class[t->cls]--;
+    if (t->cpu_affinity < 0) rq->nr_movable--;
+}
+
+// Highest class with a queued task, or -1. Read without the lock.
+static int rq_top_class(runqueue_t *rq) {
+    for (int cls = TASK_CLASS_COUNT - 1; cls >= 0; cls--) {
+        if (rq->nr_class[cls]) return cls;
+    }
+    return -1;
+}
+
+// Appends t to the run queue its affinity (or hint) selects, then makes
+// sure some CPU notices: the target if it is idle or running a lower
+// class (which t should preempt right away), otherwise an idle CPU that
+// can steal the task. A requeue of the task just switched out passes
+// wakeup = false so it does not bounce straight back in.
+static void task_enqueue(task_t *t, int hint, bool wakeup) {
+    int target = t->cpu_affinity >= 0 ? t->cpu_affinity : hint;
+    if (target < 0 || (u32)target >= cpu_count_global) target = 0;
+    runqueue_t *rq = &runqueues[target];
+
+    u64 now = clock_monotonic_ns();
+    u64 flags = spin_lock_irqsave(&rq->lock);
+    t->state = TASK_READY;
+    t->ready_ns = now;
+    t->cpu = target;
+    t->cls = t->cls_req;
+    rq_append(rq, t);
+    spin_unlock(&rq->lock);
+
+    int self = cpu_index();
+    task_t *cur = rq->pcpu->current;
+    if (rq->online && cur == rq->idle) {
+        if (target != self) rq_wake_idle(rq);
+    } else if (wakeup && rq->online && cur && cur->cls < t->cls) {
+        rq_kick(rq);
+    } else if (t->cpu_affinity < 0) {
+        for (u32 cpu = 0; cpu < cpu_count_global; cpu++) {
+            runqueue_t *other = &runqueues[cpu];
+            if ((int)cpu == self || !other->online || other->pcpu->current != other->idle) continue;
+            rq_wake_idle(other);
+            break;
+        }
+    }
+    irq_restore(flags);
+}
+
+// Takes the oldest task of the highest queued class, unless lower classes
+// have been passed over SCHED_STARVE_LIMIT times; then the lowest waiting
+// class goes first.
+static task_t *rq_pop(runqueue_t *rq) {
+    if (rq->nr == 0) return 0;
+    spin_lock(&rq->lock);
+    int top = -1;
+    int low = -1;
+    for (int cls = 0; cls < TASK_CLASS_COUNT; cls++) {
+        if (!rq->queue[cls].head) continue;
+        if (low < 0) low = cls;
+        top = cls;
+    }
+    task_t *t = 0;
+    if (top >= 0) {
+        int cls = top;
+        if (low != top && ++rq->starved >= SCHED_STARVE_LIMIT) cls = low;
+        if (cls == low) rq->starved = 0;
+        t = rq->queue[cls].head;
+        rq_unlink(rq, t, 0);
+    }
+    spin_unlock(&rq->lock);
+    return t;
+}
+
+// Takes the oldest unpinned task of the highest class from another CPU's
+// queue. Victims are peeked without their lock and only try-locked, so a
+// busy queue is skipped rather than waited on.
+static task_t *task_steal(int cpu) {
+    for (u32 n = 1; n < cpu_count_global; n++) {
+        runqueue_t *rq = &runqueues[(cpu + n) % cpu_count_global];
+        if (rq->nr_movable == 0) continue;
+        if (!spin_try_lock(&rq->lock)) continue;
+        task_t *t = 0;
+        for (int cls = TASK_CLASS_COUNT - 1; cls >= 0 && !t; cls--) {
+            task_t *prev = 0;
+            t = rq->queue[cls].head;
+            while (t && t->cpu_affinity >= 0) {
+                prev = t;
+                t = t->next;
+            }
+            if (t) rq_unlink(rq, t, prev);
+        }
+        spin_unlock(&rq->lock);
+        if (t) {
+            runqueues[cpu].steals++;
+            return t;
+        }
+    }
+    return 0;
+}
+
+static bool task_work_pending(int cpu) {
+    if (runqueues[cpu].nr) return true;
+    for (u32 i = 0; i < cpu_count_global; i++) {
+        if ((int)i != cpu && runqueues[i].nr_movable) return true;
+    }
+    return false;
+}
+
 static void task_trampoline(void) {
     asm volatile(
         "movw %0, %%ax\n"
@@ -106,104 +353,317 @@ static void task_trampoline(void) {
         : "r"(kernel_ds)
         : "ax"
     );
-    int cpu = cpu_index();
-    task_t *t = current_task[cpu];
+    task_t *t = this_cpu_read(current);
     if (!t) {
         while (1) asm volatile("hlt");
     }
     t->entry(t->arg);
-    spin_lock(&sched_lock);
+    asm volatile("cli");
     t->state = TASK_ZOMBIE;
-    t->running_cpu = -1;
-    spin_unlock(&sched_lock);
     task_yield();
     while (1) asm volatile("hlt");
 }
 
+// Catches ticks up after a tickless stretch and restarts the PIT. Runs
+// with interrupts off on the timekeeper, from the idle loop or from the
+// scheduler when something interrupts the idle hlt.
+static void tick_resume(void) {
+    if (!pit_stopped) return;
+    u64 elapsed = clock_monotonic_ns() - pit_stop_ns + pit_ns_carry;
+    u64 n = elapsed / TICK_NS;
+    pit_ns_carry = elapsed % TICK_NS;
+    pit_init(PIT_HZ);
+    // Credit the ticks before clearing the flag, so ticks_now never sees
+    // the flag clear with the old count.
+    if (n) timer_advance(n);
+    __atomic_store_n(&pit_stopped, false, __ATOMIC_RELEASE);
+    if (n) timer_run(ticks);
+}
+
+u64 ticks_now(void) {
+    if (!__atomic_load_n(&pit_stopped, __ATOMIC_ACQUIRE)) return ticks;
+    u64 derived = pit_stop_tick + (clock_monotonic_ns() - pit_stop_ns + pit_ns_carry) / TICK_NS;
+    u64 now = ticks;
+    return derived > now ? derived : now;
+}
+
+static u64 hr_next_ns(runqueue_t *rq) {
+    if (!rq->hr_sleepers) return ~0ull;
+    u64 now = clock_monotonic_ns();
+    u64 wake = rq->hr_sleepers->wake_ns;
+    return wake > now + HR_MIN_NS ? wake - now : HR_MIN_NS;
+}
+
+static void hr_expire(runqueue_t *rq, int cpu) {
+    if (!rq->hr_sleepers) return;
+    u64 now = clock_monotonic_ns();
+    while (rq->hr_sleepers && rq->hr_sleepers->wake_ns <= now) {
+        task_t *t = rq->hr_sleepers;
+        rq->hr_sleepers = t->next;
+        task_enqueue(t, cpu, true);
+    }
+}
+
+static void hr_insert(runqueue_t *rq, task_t *t) {
+    task_t **link = &rq->hr_sleepers;
+    while (*link && (*link)->wake_ns <= t->wake_ns) link = &(*link)->next;
+    t->next = *link;
+    *link = t;
+}
+
+// Programs this CPU's LAPIC timer for whoever is about to run: the
+// periodic quantum for a task, or a one-shot when a sleep_ns deadline
+// falls before the next quantum would.
+static void tick_program(runqueue_t *rq, task_t *running) {
+    bool busy = running && running != rq->idle;
+    u64 hr = hr_next_ns(rq);
+    if (hr != ~0ull) {
+        u64 quantum_ns = (u64)sched_quantum_us * NSEC_PER_USEC;
+        if (busy && hr > quantum_ns) hr = quantum_ns;
+        lapic_timer_oneshot_ns(hr);
+        rq->tick_mode = TICK_ONESHOT;
+    } else if (busy && (rq->tick_mode != TICK_PERIODIC || rq->quantum_us != sched_quantum_us)) {
+        rq->quantum_us = sched_quantum_us;
+        lapic_timer_periodic_us(rq->quantum_us);
+        rq->tick_mode = TICK_PERIODIC;
+    }
+}
+
+static void tick_stop(int cpu) {
+    runqueue_t *rq = &runqueues[cpu];
+    u64 left = hr_next_ns(rq);
+    if (cpu == timekeeper_cpu && nohz_pit) {
+        u64 now = ticks;
+        u64 next = timer_next_expiry();
+        if (next > now + 1) {
+            if (next - now > PIT_HZ) next = now + PIT_HZ;
+            pit_stop();
+            pit_stop_ns = clock_monotonic_ns();
+            pit_stop_tick = now;
+            pit_wake_tick = next;
+            __atomic_store_n(&pit_stopped, true, __ATOMIC_RELEASE);
+            u64 wheel_ns = (next - now) * TICK_NS;
+            if (wheel_ns < left) left = wheel_ns;
+        }
+    }
+    if (left != ~0ull) {
+        lapic_timer_oneshot_ns(left);
+        rq->tick_mode = TICK_ONESHOT;
+    } else if (rq->tick_mode != TICK_STOPPED) {
+        lapic_timer_stop();
+        rq->tick_mode = TICK_STOPPED;
+    }
+}
+
+// A timer armed from another CPU may be due before the timekeeper's
+// one-shot; nudge it so it reprograms.
+static void task_timer_added(u64 expires) {
+    if (!pit_stopped || expires >= pit_wake_tick) return;
+    if (cpu_index() == timekeeper_cpu) return;
+    rq_kick(&runqueues[timekeeper_cpu]);
+}
+
+static void task_count_wakeup(runqueue_t *rq) {
+    rq->wakeups++;
+    u64 second = uptime_seconds;
+    if (second != rq->wake_second) {
+        rq->wake_rate = second == rq->wake_second + 1 ? rq->wake_count : 0;
+        rq->wake_count = 0;
+        rq->wake_second = second;
+    }
+    rq->wake_count++;
+}
+
+// Spins up to idle_poll_us waiting for work before the idle loop halts.
+// Waking from hlt costs an IPI plus the exit from the sleep state, which
+// dwarfs the wakeup itself when work arrives again within microseconds.
+// Returns with idle_polling clear, so the caller's final check before hlt
+// cannot miss a waker that skipped the IPI.
+static bool task_idle_poll(percpu_t *pcpu, int cpu) {
+    u32 us = idle_poll_us;
+    if (us == 0 || !clock_tsc_hz()) return false;
+    pcpu->idle_polling = 1;
+    asm volatile("mfence" : : : "memory");
+    u64 end = clock_monotonic_ns() + (u64)us * NSEC_PER_USEC;
+    bool found;
+    while (!(found = task_work_pending(cpu)) && clock_monotonic_ns() < end) {
+        asm volatile("pause");
+    }
+    __atomic_store_n(&pcpu->idle_polling, 0, __ATOMIC_SEQ_CST);
+    return found;
+}
+
 static void task_idle(void *arg) {
     (void)arg;
+    int cpu = cpu_index();
+    runqueue_t *rq = &runqueues[cpu];
+    percpu_t *pcpu = rq->pcpu;
     while (1) {
-        asm volatile("hlt");
+        if (task_idle_poll(pcpu, cpu)) {
+            task_yield();
+            continue;
+        }
+        // sti only takes effect after the next instruction, so a wakeup
+        // arriving after the check still interrupts the hlt.
+        asm volatile("cli");
+        if (task_work_pending(cpu)) {
+            asm volatile("sti");
+            task_yield();
+        } else {
+            tick_stop(cpu);
+            asm volatile("sti; hlt");
+            asm volatile("cli");
+            if (cpu == timekeeper_cpu) tick_resume();
+            task_count_wakeup(rq);
+            asm volatile("sti");
+        }
     }
 }
 
-static void task_cleanup(void) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_ZOMBIE) {
-            if (tasks[i].stack) {
-                free(tasks[i].stack);
-                tasks[i].stack = 0;
-            }
-            tasks[i].state = TASK_UNUSED;
-            tasks[i].running_cpu = -1;
-        }
+static task_t *task_by_id(u32 id) {
+    u32 chunk = id / TASK_CHUNK;
+    if (chunk >= task_chunk_count) return 0;
+    return &task_chunks[chunk][id % TASK_CHUNK];
+}
+
+// A dead task keeps its FPU area for the next one to use its slot; the
+// stack goes back to the pool. Neither touches the general heap.
+static void task_reap(task_t *t) {
+    if (t->stack) {
+        kstack_free(t->stack);
+        t->stack = 0;
     }
+    spin_lock(&task_lock);
+    t->state = TASK_UNUSED;
+    t->free_next = task_free_list;
+    task_free_list = t;
+    task_count--;
+    spin_unlock(&task_lock);
 }
 
-static int task_find_free(void) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_UNUSED) return i;
+// Called with task_lock held. Allocating under a spinlock is fine here:
+// chunks are rare and the heap never sleeps.
+static task_t *task_grow(void) {
+    if (task_chunk_count >= TASK_MAX_CHUNKS) return 0;
+    task_t *chunk = (task_t *)malloc(sizeof(task_t) * TASK_CHUNK);
+    if (!chunk) return 0;
+    memset(chunk, 0, sizeof(task_t) * TASK_CHUNK);
+    u32 base = task_chunk_count * TASK_CHUNK;
+    for (int i = TASK_CHUNK - 1; i >= 0; i--) {
+        task_t *t = &chunk[i];
+        t->id = base + (u32)i;
+        t->state = TASK_UNUSED;
+        t->cpu = -1;
+        t->cpu_affinity = -1;
+        t->fpu.last_cpu = -1;
+        t->free_next = task_free_list;
+        task_free_list = t;
     }
-    return -1;
+    task_chunks[task_chunk_count++] = chunk;
+    return task_free_list;
 }
 
-static task_t *task_pick_next(int cpu) {
-    task_t *idle_candidate = 0;
-    int idle_index_candidate = -1;
-    int start = (last_pick[cpu] + 1) % MAX_TASKS;
-    for (int n = 0; n < MAX_TASKS; n++) {
-        int i = (start + n) % MAX_TASKS;
-        task_t *t = &tasks[i];
-        if (t->state != TASK_READY) continue;
-        if (t->running_cpu != -1) continue;
-        if (t->cpu_affinity >= 0 && t->cpu_affinity != cpu) continue;
-        if (!t->is_idle) {
-            last_pick[cpu] = i;
-            return t;
-        }
-        if (!idle_candidate) {
-            idle_candidate = t;
-            idle_index_candidate = i;
+static int task_place(void) {
+    int best = -1;
+    u32 best_nr = 0;
+    for (u32 cpu = 0; cpu < cpu_count_global; cpu++) {
+        runqueue_t *rq = &runqueues[cpu];
+        if (!rq->online) continue;
+        u32 load = rq->nr + (rq->pcpu->current != rq->idle);
+        if (best < 0 || load < best_nr) {
+            best = (int)cpu;
+            best_nr = load;
         }
     }
-    if (idle_candidate) {
-        last_pick[cpu] = idle_index_candidate;
+    return best >= 0 ? best : cpu_index();
+}
+
+static task_t *task_alloc(const char *name, task_entry_t entry, void *arg, int cpu) {
+    u64 flags = spin_lock_irqsave(&task_lock);
+    task_t *t = task_free_list ? task_free_list : task_grow();
+    if (!t) {
+        spin_unlock_irqrestore(&task_lock, flags);
+        return 0;
     }
-    return idle_candidate;
+    // Claim the slot before dropping the lock to allocate.
+    task_free_list = t->free_next;
+    t->free_next = 0;
+    t->state = TASK_SLEEPING;
+    task_count++;
+    spin_unlock_irqrestore(&task_lock, flags);
+
+    void *stack = kstack_alloc();
+    int fpu_rc = 0;
+    if (t->fpu.area) fpu_state_reset(&t->fpu);
+    else fpu_rc = fpu_state_init(&t->fpu);
+    if (!stack || fpu_rc != 0) {
+        if (stack) kstack_free(stack);
+        flags = spin_lock_irqsave(&task_lock);
+        t->state = TASK_UNUSED;
+        t->free_next = task_free_list;
+        task_free_list = t;
+        task_count--;
+        spin_unlock_irqrestore(&task_lock, flags);
+        return 0;
+    }
+
+    t->name = name;
+    t->entry = entry;
+    t->arg = arg;
+    t->stack = stack;
+    t->wake_tick = 0;
+    t->wake_ns = 0;
+    t->hr_sleep = false;
+    t->cpu_affinity = cpu;
+    t->cpu = cpu;
+    t->is_idle = 0;
+    t->cls = TASK_CLASS_NORMAL;
+    t->cls_req = TASK_CLASS_NORMAL;
+    t->sleep_timer.next = 0;
+    t->sleep_timer.pprev = 0;
+    t->voluntary = 0;
+    t->involuntary = 0;
+    t->runtime_ns = 0;
+    t->wait_ns = 0;
+    t->exec_start_ns = 0;
+    t->ready_ns = 0;
+    t->next = 0;
+    t->ctx.rsp = task_build_stack(stack, task_trampoline);
+    return t;
 }
 
 void task_init(u32 cpu_count) {
     asm volatile("mov %%cs, %0" : "=r"(kernel_cs));
     asm volatile("mov %%ds, %0" : "=r"(kernel_ds));
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].state = TASK_UNUSED;
-        tasks[i].stack = 0;
-        tasks[i].running_cpu = -1;
-        tasks[i].cpu_affinity = -1;
-        tasks[i].is_idle = 0;
-    }
-    for (int i = 0; i < 64; i++) {
-        current_task[i] = 0;
-        idle_index[i] = -1;
-        last_pick[i] = -1;
-    }
-    sched_lock.locked = 0;
+    if (cpu_count > MAX_CPUS) cpu_count = MAX_CPUS;
+    if (cpu_count == 0) cpu_count = 1;
     cpu_count_global = cpu_count;
-    for (u32 cpu = 0; cpu < cpu_count_global && cpu < 64; cpu++) {
-        int idx = task_create_affinity("idle", task_idle, NULL, (int)cpu);
-        idle_index[cpu] = idx;
-        if (idx >= 0) {
-            tasks[idx].is_idle = 1;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        runqueue_t *rq = &runqueues[cpu];
+        memset(rq, 0, sizeof(*rq));
+        rq->pcpu = percpu_get((u32)cpu);
+        rq->pcpu->rq = rq;
+        rq->pcpu->current = 0;
+    }
+    spin_lock_init(&task_lock);
+    spin_lock_profile(&task_lock, "task", -1);
+    for (u32 cpu = 0; cpu < cpu_count_global && cpu < MAX_CPUS; cpu++) {
+        spin_lock_profile(&runqueues[cpu].lock, "runqueue", (int)cpu);
+    }
+    // Idle tasks are never queued; each CPU falls back to its own.
+    for (u32 cpu = 0; cpu < cpu_count_global; cpu++) {
+        task_t *idle = task_alloc("idle", task_idle, NULL, (int)cpu);
+        if (idle) {
+            idle->is_idle = 1;
+            idle->state = TASK_READY;
+            runqueues[cpu].idle = idle;
         }
     }
     scheduler_active = 0;
 }
 
 void task_register_cpu(u32 lapic_id, u32 index) {
-    if (lapic_id < 256) {
-        lapic_map[lapic_id] = index;
-        if (index + 1 > lapic_map_count) lapic_map_count = index + 1;
-    }
+    if (index < MAX_CPUS) percpu_get(index)->lapic_id = lapic_id;
 }
 
 int task_create(const char *name, task_entry_t entry, void *arg) {
@@ -211,139 +671,386 @@ int task_create(const char *name, task_entry_t entry, void *arg) {
 }
 
 int task_create_affinity(const char *name, task_entry_t entry, void *arg, int cpu) {
-    spin_lock(&sched_lock);
-    int idx = task_find_free();
-    if (idx < 0) {
-        spin_unlock(&sched_lock);
-        return -1;
-    }
-    task_t *t = &tasks[idx];
-    void *stack = malloc(TASK_STACK_SIZE);
-    if (!stack) {
-        spin_unlock(&sched_lock);
-        return -1;
-    }
+    return task_create_class(name, entry, arg, cpu, TASK_CLASS_NORMAL);
+}
 
-    t->state = TASK_READY;
-    t->name = name;
-    t->entry = entry;
-    t->arg = arg;
-    t->stack = stack;
-    t->wake_tick = 0;
-    t->cpu_affinity = cpu;
-    t->running_cpu = -1;
-    t->is_idle = 0;
-    t->ctx.rsp = task_build_stack(stack, task_trampoline);
-    task_count++;
-    spin_unlock(&sched_lock);
-    return idx;
+int task_create_class(const char *name, task_entry_t entry, void *arg, int cpu, task_class_t cls) {
+    if (cls >= TASK_CLASS_COUNT) return -1;
+    if (cpu >= (int)cpu_count_global) cpu = -1;
+    task_t *t = task_alloc(name, entry, arg, cpu);
+    if (!t) return -1;
+    t->cls = cls;
+    t->cls_req = cls;
+    task_enqueue(t, task_place(), true);
+    return (int)t->id;
 }
 
-void task_start_bsp(void) {
-    int cpu = 0;
-    if (idle_index[cpu] >= 0) {
-        current_task[cpu] = &tasks[idle_index[cpu]];
-        current_task[cpu]->state = TASK_RUNNING;
-        current_task[cpu]->running_cpu = lapic_id();
+// The class only changes when the task is next queued, under that run
+// queue's lock, so queue bookkeeping never sees a task switch lists. A
+// CPU-bound task picks it up at its next preemption, a sleeper when it
+// wakes.
+int task_set_class(u32 index, task_class_t cls) {
+    task_t *t = task_by_id(index);
+    if (!t || cls >= TASK_CLASS_COUNT) return -1;
+    if (t->state == TASK_UNUSED || t->is_idle) return -1;
+    t->cls_req = cls;
+    return 0;
+}
+
+const char *task_class_name(task_class_t cls) {
+    switch (cls) {
+        case TASK_CLASS_INTERACTIVE: return "interactive";
+        case TASK_CLASS_NORMAL: return "normal";
+        case TASK_CLASS_BACKGROUND: return "background";
+        default: return "?";
     }
-    scheduler_active = 1;
-    task_yield();
 }
 
-void task_start_ap(void) {
-    int cpu = cpu_index();
-    if (idle_index[cpu] >= 0) {
-        current_task[cpu] = &tasks[idle_index[cpu]];
-        current_task[cpu]->state = TASK_RUNNING;
-        current_task[cpu]->running_cpu = lapic_id();
+static void task_start(int cpu) {
+    runqueue_t *rq = &runqueues[cpu];
+    if (rq->idle) {
+        rq->pcpu->current = rq->idle;
+        rq->idle->state = TASK_RUNNING;
+        rq->idle->cpu = cpu;
+        rq->idle->exec_start_ns = clock_monotonic_ns();
     }
+    rq->online = 1;
+    rq->quantum_us = sched_quantum_us;
+    rq->tick_mode = TICK_PERIODIC;
     scheduler_active = 1;
+    lapic_timer_periodic_us(rq->quantum_us);
     task_yield();
 }
 
+void task_start_bsp(void) {
+    timekeeper_cpu = cpu_index();
+    nohz_pit = clock_tsc_invariant() && clock_tsc_hz() != 0;
+    timer_set_hook(task_timer_added);
+    task_start(timekeeper_cpu);
+}
+
+void task_start_ap(void) {
+    task_start(cpu_index());
+}
+
+// The LAPIC timer shares vector 0xF0; the flag tells the scheduler this
+// entry was asked for rather than a preemption.
 void task_yield(void) {
     if (!scheduler_active) return;
+    u64 flags = irq_save();
+    this_cpu()->rq->yielding = 1;
     asm volatile("int $0xF0");
+    irq_restore(flags);
 }
 
 void task_preempt(void) {
     task_yield();
 }
 
-void task_tick(void) {
-    if (!scheduler_active) return;
-    if (!spin_try_lock(&sched_lock)) return;
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_SLEEPING && ticks >= tasks[i].wake_tick) {
-            tasks[i].state = TASK_READY;
-        }
-    }
-    spin_unlock(&sched_lock);
+static void task_wake(void *arg) {
+    task_t *t = (task_t *)arg;
+    task_enqueue(t, t->cpu, true);
 }
 
 void task_sleep(u64 sleep_ticks) {
-    int cpu = cpu_index();
-    task_t *t = current_task[cpu];
-    if (!t) return;
-    spin_lock(&sched_lock);
+    task_t *t = this_cpu_read(current);
+    if (!scheduler_active || !t || t->is_idle) {
+        cpu_sleep_ticks(sleep_ticks);
+        return;
+    }
+    u64 flags = irq_save();
+    t->wake_tick = ticks_now() + sleep_ticks;
+    t->hr_sleep = false;
+    t->state = TASK_SLEEPING;
+    task_yield();
+    irq_restore(flags);
+}
+
+// Sleeps against the TSC clock rather than the wheel's ticks. The wakeup
+// comes from this CPU's LAPIC one-shot, so the resolution is that of the
+// timer, not of PIT_HZ.
+void sleep_ns(u64 ns) {
+    u64 deadline = clock_monotonic_ns() + ns;
+    task_t *t = scheduler_active ? this_cpu_read(current) : 0;
+    if (!t || t->is_idle) {
+        while (clock_monotonic_ns() < deadline) asm volatile("pause");
+        return;
+    }
+    u64 flags = irq_save();
+    t->wake_ns = deadline;
+    t->hr_sleep = true;
     t->state = TASK_SLEEPING;
-    t->wake_tick = ticks + sleep_ticks;
-    t->running_cpu = -1;
-    spin_unlock(&sched_lock);
+    task_yield();
+    irq_restore(flags);
+}
+
+void sleep_us(u64 us) {
+    sleep_ns(us * NSEC_PER_USEC);
+}
+
+bool task_can_block(void) {
+    if (!scheduler_active) return false;
+    task_t *t = this_cpu_read(current);
+    return t && !t->is_idle;
+}
+
+struct task *task_current(void) {
+    return this_cpu_read(current);
+}
+
+static void task_block_expired(void *arg) {
+    task_unblock((task_t *)arg);
+}
+
+// Marks the current task as about to block. Until task_block switches it
+// out it keeps running, and a task_unblock in between just cancels the
+// block. A nonzero deadline arms the sleep timer as a timeout.
+void task_block_prepare(u64 deadline) {
+    u64 flags = irq_save();
+    task_t *t = this_cpu_read(current);
+    t->state = TASK_BLOCKING;
+    if (deadline) timer_add(&t->sleep_timer, deadline, task_block_expired, t);
+    irq_restore(flags);
+}
+
+void task_block(void) {
     task_yield();
 }
 
+void task_block_finish(void) {
+    u64 flags = irq_save();
+    task_t *t = this_cpu_read(current);
+    if (timer_pending(&t->sleep_timer)) timer_cancel(&t->sleep_timer);
+    t->state = TASK_RUNNING;
+    irq_restore(flags);
+}
+
+// Safe from interrupt handlers and timer callbacks. A stale call after the
+// task has moved on only causes a spurious wakeup, which waiters tolerate.
+void task_unblock(struct task *t) {
+    if (!t) return;
+    if (__sync_bool_compare_and_swap(&t->state, TASK_BLOCKING, TASK_RUNNING)) return;
+    if (__sync_bool_compare_and_swap(&t->state, TASK_BLOCKED, TASK_READY)) {
+        task_enqueue(t, t->cpu, true);
+    }
+}
+
 const char *task_current_name(void) {
-    int cpu = cpu_index();
-    if (!current_task[cpu]) return "none";
-    return current_task[cpu]->name ? current_task[cpu]->name : "task";
+    task_t *t = this_cpu_read(current);
+    if (!t) return "none";
+    return t->name ? t->name : "task";
+}
+
+u32 task_slots(void) {
+    return task_chunk_count * TASK_CHUNK;
+}
+
+u32 task_live_count(void) {
+    return task_count;
+}
+
+u32 task_idle_poll_us(void) {
+    return idle_poll_us;
+}
+
+int task_set_idle_poll_us(u32 us) {
+    if (us > IDLE_POLL_MAX_US) return -1;
+    idle_poll_us = us;
+    return 0;
+}
+
+u32 task_quantum_us(void) {
+    return sched_quantum_us;
+}
+
+int task_set_quantum_us(u32 us) {
+    if (us < SCHED_QUANTUM_MIN_US || us > SCHED_QUANTUM_MAX_US) return -1;
+    // Each CPU re-arms its own timer on its next scheduler entry.
+    sched_quantum_us = us;
+    return 0;
+}
+
+int task_info(u32 index, task_info_t *out) {
+    task_t *t = task_by_id(index);
+    if (!t || !out) return -1;
+    if (t->state == TASK_UNUSED) return -1;
+    out->name = t->name ? t->name : "task";
+    out->cpu = t->cpu;
+    out->affinity = t->cpu_affinity;
+    out->idle = t->is_idle != 0;
+    out->cls = t->cls_req;
+    out->voluntary = t->voluntary;
+    out->involuntary = t->involuntary;
+    // The running stretch has not been charged yet. Read unlocked, so
+    // the figures are a snapshot, not exact.
+    u64 now = clock_monotonic_ns();
+    out->runtime_ns = t->runtime_ns;
+    out->wait_ns = t->wait_ns;
+    if (t->state == TASK_RUNNING && now > t->exec_start_ns) {
+        out->runtime_ns += now - t->exec_start_ns;
+    } else if (t->state == TASK_READY && !t->is_idle && now > t->ready_ns) {
+        out->wait_ns += now - t->ready_ns;
+    }
+    switch (t->state) {
+        case TASK_READY: out->state = "ready"; break;
+        case TASK_RUNNING: out->state = "running"; break;
+        case TASK_SLEEPING: out->state = "sleeping"; break;
+        case TASK_BLOCKING:
+        case TASK_BLOCKED: out->state = "blocked"; break;
+        default: out->state = "exiting"; break;
+    }
+    return 0;
+}
+
+u32 task_cpu_count(void) {
+    return cpu_count_global;
+}
+
+int task_cpu_stats(u32 cpu, task_cpu_stats_t *out) {
+    if (cpu >= cpu_count_global || !out) return -1;
+    runqueue_t *rq = &runqueues[cpu];
+    task_t *cur = rq->pcpu->current;
+    out->online = rq->online != 0;
+    out->queued = rq->nr;
+    out->current = cur ? (cur->name ? cur->name : "task") : "none";
+    out->switches = rq->switches;
+    out->steals = rq->steals;
+    out->fast_path = rq->fast_path;
+    out->kicks = rq->kicks;
+    out->poll_hits = rq->poll_hits;
+    out->busy_ns = rq->busy_ns;
+    out->idle_ns = rq->idle ? rq->idle->runtime_ns : 0;
+    u64 now = clock_monotonic_ns();
+    if (cur && rq->online && now > cur->exec_start_ns) {
+        if (cur == rq->idle) out->idle_ns += now - cur->exec_start_ns;
+        else out->busy_ns += now - cur->exec_start_ns;
+    }
+    out->preemptions = rq->preemptions;
+    out->tick_stopped = rq->tick_mode == TICK_STOPPED;
+    out->wakeups = rq->wakeups;
+    out->wakeups_per_sec = uptime_seconds > rq->wake_second + 1 ? 0 : rq->wake_rate;
+    return 0;
+}
+
+// Only task_block may take a BLOCKING task off the CPU. A tick or IPI can
+// land after wait_prepare re-enables interrupts but before the caller
+// re-checks its condition; a waker that ran before the entry was linked
+// has already come and gone, so the task must stay runnable and recheck.
+static task_t *task_pick(runqueue_t *rq, int cpu, task_t *prev, bool voluntary) {
+    bool runnable = !prev->is_idle &&
+                    (prev->state == TASK_RUNNING || (prev->state == TASK_BLOCKING && !voluntary));
+
+    // Nothing of prev's class or above queued here: keep running without
+    // touching any lock, unless lower classes have waited long enough.
+    int top = rq_top_class(rq);
+    if (runnable && top < (int)prev->cls &&
+        (top < 0 || ++rq->starved < SCHED_STARVE_LIMIT)) {
+        rq->fast_path++;
+        return prev;
+    }
+
+    task_t *next = rq_pop(rq);
+    if (!next) next = task_steal(cpu);
+    while (next && !task_frame_valid(next->ctx.rsp)) {
+        next->state = TASK_ZOMBIE;
+        task_reap(next);
+        next = rq_pop(rq);
+    }
+    if (next) return next;
+    if (runnable || prev->is_idle) {
+        rq->fast_path++;
+        return prev;
+    }
+    return rq->idle ? rq->idle : prev;
 }
 
 u64 task_schedule_isr(u64 rsp) {
+    percpu_t *pcpu = this_cpu();
+    pcpu->isr_tsc = rdtsc();
     if (!scheduler_active) return rsp;
 
-    int cpu = cpu_index();
-    if (!spin_try_lock(&sched_lock)) return rsp;
-    task_cleanup();
-
-    task_t *prev = current_task[cpu];
-    if (prev) {
-        prev->ctx.rsp = rsp;
-        if (prev->state == TASK_RUNNING) {
-            prev->state = TASK_READY;
-            prev->running_cpu = -1;
-        }
-    }
+    int cpu = (int)pcpu->index;
+    runqueue_t *rq = pcpu->rq;
+    bool voluntary = rq->yielding != 0;
+    rq->yielding = 0;
+    if (cpu == timekeeper_cpu) tick_resume();
+    hr_expire(rq, cpu);
+    task_t *prev = pcpu->current;
+    if (!prev) return rsp;
+    prev->ctx.rsp = rsp;
 
-    task_t *next = task_pick_next(cpu);
-    if (!next) {
-        if (prev) {
-            prev->state = TASK_RUNNING;
-            prev->running_cpu = lapic_id();
-        }
-        spin_unlock(&sched_lock);
-        return rsp;
-    }
-
-    if (next != prev) {
-        next->state = TASK_RUNNING;
-        next->running_cpu = lapic_id();
-        current_task[cpu] = next;
-    } else if (prev) {
-        prev->state = TASK_RUNNING;
-        prev->running_cpu = lapic_id();
-    }
-    u64 next_rsp = current_task[cpu]->ctx.rsp;
-    if (next_rsp) {
-        u64 *frame = (u64 *)next_rsp;
-        u64 rip = frame[15];
-        u64 cs = frame[16];
-        if (cs != kernel_cs || (rip & 0xFFFF800000000000ull) != 0xFFFF800000000000ull) {
-            next_rsp = rsp;
-        }
+    task_t *next = task_pick(rq, cpu, prev, voluntary);
+    tick_program(rq, next);
+    if (next == prev) return rsp;
+
+    // Preempted while blocking: requeue it like any preempted task. Its
+    // task_block then just yields and the wait loop checks again.
+    if (!voluntary) __sync_bool_compare_and_swap(&prev->state, TASK_BLOCKING, TASK_RUNNING);
+
+    if (voluntary) {
+        prev->voluntary++;
     } else {
-        next_rsp = rsp;
+        prev->involuntary++;
+        if (!prev->is_idle) rq->preemptions++;
     }
-    spin_unlock(&sched_lock);
-    return next_rsp;
+    u64 now = clock_monotonic_ns();
+    u64 ran = now - prev->exec_start_ns;
+    prev->runtime_ns += ran;
+    if (!prev->is_idle) rq->busy_ns += ran;
+    if (!next->is_idle) next->wait_ns += now - next->ready_ns;
+    next->exec_start_ns = now;
+    fpu_switch(&prev->fpu);
+    // An irqs-off section cannot span a switch; the next task's restore
+    // must not close prev's.
+    pcpu->irqoff_tsc = 0;
+    rq->switched_from = prev;
+    next->state = TASK_RUNNING;
+    next->cpu = cpu;
+    pcpu->current = next;
+    rq->switches++;
+    return next->ctx.rsp;
+}
+
+static void task_settle_prev(percpu_t *pcpu) {
+    int cpu = (int)pcpu->index;
+    runqueue_t *rq = pcpu->rq;
+    task_t *prev = rq->switched_from;
+    if (!prev) return;
+    rq->switched_from = 0;
+
+    switch (prev->state) {
+        case TASK_RUNNING:
+            if (prev->is_idle) prev->state = TASK_READY;
+            else task_enqueue(prev, cpu, false);
+            break;
+        case TASK_SLEEPING:
+            if (prev->hr_sleep) {
+                hr_insert(rq, prev);
+                tick_program(rq, pcpu->current);
+            } else {
+                timer_add(&prev->sleep_timer, prev->wake_tick, task_wake, prev);
+            }
+            break;
+        case TASK_BLOCKING:
+            // From here on a wakeup sees BLOCKED and requeues the task
+            // itself; if one already came, the CAS fails and we do it.
+            if (!__sync_bool_compare_and_swap(&prev->state, TASK_BLOCKING, TASK_BLOCKED)) {
+                task_enqueue(prev, cpu, false);
+            }
+            break;
+        case TASK_ZOMBIE:
+            task_reap(prev);
+            break;
+        default:
+            break;
+    }
+}
+
+// Runs on the incoming task's stack, once nothing refers to prev's stack,
+// as the last step of the 0xF0 handler.
+void task_finish_switch(void) {
+    percpu_t *pcpu = this_cpu();
+    if (scheduler_active) task_settle_prev(pcpu);
+    irqstat_record(IRQSTAT_SCHED, pcpu->isr_tsc);
+    softirq_irq_exit();
 }
@@ -0,0 +1,167 @@
+#include "kernel/timer.h"
+#include "kernel/cpu.h"
+#include "kernel/spinlock.h"
+
+// Hierarchical timing wheel: four levels of 64 slots, each level covering
+// 64 times the span of the one below. A timer is filed by how far away it
+// is, the tick handler only looks at the current level-0 slot, and every
+// 64 ticks one slot of the next level is cascaded down. Work per tick is
+// proportional to the timers that expire, not to the number pending.
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1u << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1ull << (WHEEL_BITS * WHEEL_LEVELS))
+
+timer_stats_t timer_stats;
+
+static ktimer_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static u64 wheel_tick = 0;
+static bool wheel_started = false;
+static spinlock_t timer_lock;
+static timer_hook_t timer_hook = NULL;
+
+static void slot_insert(ktimer_t **slot, ktimer_t *t) {
+    t->next = *slot;
+    if (*slot) (*slot)->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+}
+
+static void slot_remove(ktimer_t *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void wheel_insert(ktimer_t *t) {
+    u64 expires = t->expires;
+    if ((i64)(expires - wheel_tick) < 0) expires = wheel_tick;
+    u64 delta = expires - wheel_tick;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        expires = wheel_tick + delta;
+    }
+    u32 level = 0;
+    while (level + 1 < WHEEL_LEVELS && delta >= (1ull << (WHEEL_BITS * (level + 1)))) level++;
+    u32 index = (u32)(expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    slot_insert(&wheel[level][index], t);
+}
+
+// Re-files every timer of one slot against the current tick; returns the
+// slot index so the caller knows whether the level above wrapped too.
+static u32 wheel_cascade(u32 level) {
+    u32 index = (u32)(wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    ktimer_t *t = wheel[level][index];
+    wheel[level][index] = NULL;
+    while (t) {
+        ktimer_t *next = t->next;
+        wheel_insert(t);
+        timer_stats.cascaded++;
+        t = next;
+    }
+    return index;
+}
+
+void timer_add(ktimer_t *t, u64 expires, timer_fn_t fn, void *arg) {
+    u64 flags = spin_lock_irqsave(&timer_lock);
+    if (!wheel_started) {
+        wheel_tick = ticks;
+        wheel_started = true;
+    }
+    if (t->pprev) slot_remove(t);
+    else timer_stats.pending++;
+    t->expires = expires;
+    t->fn = fn;
+    t->arg = arg;
+    wheel_insert(t);
+    spin_unlock_irqrestore(&timer_lock, flags);
+    if (timer_hook) timer_hook(expires);
+}
+
+void timer_set_hook(timer_hook_t hook) {
+    timer_hook = hook;
+}
+
+bool timer_cancel(ktimer_t *t) {
+    u64 flags = spin_lock_irqsave(&timer_lock);
+    bool pending = t->pprev != NULL;
+    if (pending) {
+        slot_remove(t);
+        timer_stats.pending--;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return pending;
+}
+
+bool timer_pending(const ktimer_t *t) {
+    return t->pprev != NULL;
+}
+
+// Earliest tick at which timer_run could have work: exact for timers on
+// level 0, bounded by the next cascade while higher levels hold timers.
+// Returns ~0 when nothing is pending. Used to decide how long the tick
+// may stop.
+u64 timer_next_expiry(void) {
+    u64 flags = spin_lock_irqsave(&timer_lock);
+    u64 next = ~0ull;
+    for (u32 i = 0; i < WHEEL_SIZE; i++) {
+        if (wheel[0][(wheel_tick + i) & WHEEL_MASK]) {
+            next = wheel_tick + i;
+            break;
+        }
+    }
+    u64 cascade = (wheel_tick + WHEEL_MASK) & ~(u64)WHEEL_MASK;
+    if (cascade < next) {
+        for (u32 level = 1; level < WHEEL_LEVELS && next != cascade; level++) {
+            for (u32 i = 0; i < WHEEL_SIZE; i++) {
+                if (wheel[level][i]) {
+                    next = cascade;
+                    break;
+                }
+            }
+        }
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return next;
+}
+
+// Called from the PIT interrupt. Catches up tick by tick, so a delayed
+// interrupt still fires every timer in order.
+void timer_run(u64 now) {
+    spin_lock(&timer_lock);
+    if (!wheel_started) {
+        wheel_tick = now;
+        wheel_started = true;
+    }
+    while ((i64)(now - wheel_tick) >= 0) {
+        u32 index = (u32)wheel_tick & WHEEL_MASK;
+        if (index == 0) {
+            for (u32 level = 1; level < WHEEL_LEVELS; level++) {
+                if (wheel_cascade(level) != 0) break;
+            }
+        }
+        wheel_tick++;
+        // Detach the slot first: a timer armed while a callback runs with
+        // the lock dropped may hash to this same slot, and belongs to its
+        // next turn, not this one. Cancel and re-arm still unlink through
+        // pprev, which now points at the local list.
+        ktimer_t *expired = wheel[0][index];
+        wheel[0][index] = NULL;
+        if (expired) expired->pprev = &expired;
+        while (expired) {
+            ktimer_t *t = expired;
+            slot_remove(t);
+            timer_stats.pending--;
+            timer_stats.fired++;
+            timer_fn_t fn = t->fn;
+            void *arg = t->arg;
+            // The callback may re-arm its own timer.
+            spin_unlock(&timer_lock);
+            fn(arg);
+            spin_lock(&timer_lock);
+        }
+    }
+    spin_unlock(&timer_lock);
+}
@@ -0,0 +1,408 @@
+#include "kernel/vmm.h"
+#include "kernel/cpu.h"
+#include "kernel/memory.h"
+#include "kernel/spinlock.h"
+
+#define PTE_PRESENT  (1ull << 0)
+#define PTE_WRITE    (1ull << 1)
+#define PTE_PWT      (1ull << 3)
+#define PTE_PCD      (1ull << 4)
+#define PTE_HUGE     (1ull << 7)
+#define PTE_PAT_4K   (1ull << 7)
+#define PTE_GLOBAL   (1ull << 8)
+#define PTE_PAT_HUGE (1ull << 12)
+#define PTE_NX       (1ull << 63)
+#define PTE_ADDR     0x000FFFFFFFFFF000ull
+
+#define MSR_PAT  0x277
+#define MSR_EFER 0xC0000080
+#define EFER_NXE (1ull << 11)
+#define CR4_PGE  (1ull << 7)
+
+#define SIZE_2M (2ull << 20)
+#define SIZE_1G (1ull << 30)
+
+// Past this many pages a range update reloads the whole TLB instead of
+// issuing one invlpg per page.
+#define VMM_FLUSH_THRESHOLD 64
+
+typedef struct {
+    u16 limit;
+    u64 base;
+} __attribute__((packed)) descriptor_ptr_t;
+
+extern u8 __rodata_start[];
+extern u8 __data_start[];
+extern u8 __kernel_end[];
+
+vmm_stats_t vmm_stats;
+
+static u64 *pml4 = NULL;
+static u64 pml4_phys = 0;
+static bool vmm_active = false;
+static spinlock_t vmm_lock;
+
+// Limine's GDT lives in bootloader memory that is only reachable through
+// its own identity map, so every CPU switches to this copy.
+static u64 gdt[16] __attribute__((aligned(16)));
+static descriptor_ptr_t gdt_ptr;
+
+// PAT layout loaded on every CPU (same as Linux): WB, WC, UC-, UC, WB, WP,
+// UC-, WT. Entries 0, 2 and 3 match the power-on layout.
+#define PAT_LAYOUT 0x0407050600070106ull
+
+// PAT index for each VMM_CACHE_* type, with and without PAT support. The
+// power-on layout has no WC or WP entry, so those degrade to UC-.
+static const u8 cache_pat_kernel[8] = {0, 7, 2, 3, 1, 5, 0, 0};
+static const u8 cache_pat_default[8] = {0, 1, 2, 3, 2, 2, 0, 0};
+static const u8 *cache_pat_index = cache_pat_default;
+
+static u64 level_size(int level) {
+    return 1ull << (12 + 9 * level);
+}
+
+static u32 level_index(u64 virt, int level) {
+    return (u32)((virt >> (12 + 9 * level)) & 511);
+}
+
+static u64 *entry_table(u64 entry) {
+    return (u64 *)phys_to_virt(entry & PTE_ADDR);
+}
+
+static u64 entry_phys(u64 entry, int level) {
+    return entry & PTE_ADDR & ~(level_size(level) - 1);
+}
+
+static void count_leaf(int level, int delta) {
+    if (level == 2) vmm_stats.pages_1g += (u64)(i64)delta;
+    else if (level == 1) vmm_stats.pages_2m += (u64)(i64)delta;
+    else vmm_stats.pages_4k += (u64)(i64)delta;
+}
+
+static u64 leaf_bits(u32 flags, int level) {
+    u64 bits = PTE_PRESENT;
+    if (flags & VMM_WRITE) bits |= PTE_WRITE;
+    if (vmm_stats.global_pages) bits |= PTE_GLOBAL;
+    if (!(flags & VMM_EXEC) && vmm_stats.nx) bits |= PTE_NX;
+
+    u8 pat = cache_pat_index[(flags & VMM_CACHE_MASK) >> 4];
+    if (pat & 1) bits |= PTE_PWT;
+    if (pat & 2) bits |= PTE_PCD;
+    if (pat & 4) bits |= level ? PTE_PAT_HUGE : PTE_PAT_4K;
+    if (level) bits |= PTE_HUGE;
+    return bits;
+}
+
+static u64 *table_alloc(u64 *out_phys) {
+    u64 *table = page_alloc(0, out_phys);
+    if (!table) return NULL;
+    memset(table, 0, PAGE_SIZE);
+    vmm_stats.table_pages++;
+    return table;
+}
+
+static inline u64 read_cr4(void) {
+    u64 value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(u64 value) {
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void write_cr3(u64 value) {
+    asm volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static void tlb_flush_all(void) {
+    u64 cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        // Toggling PGE drops global entries too, which a CR3 reload keeps.
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        write_cr3(pml4_phys);
+    }
+    vmm_stats.full_flushes++;
+}
+
+static void flush_page(u64 virt, u64 *pending) {
+    if (!vmm_active) return;
+    if (*pending < VMM_FLUSH_THRESHOLD) {
+        asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+        vmm_stats.invlpg++;
+    }
+    (*pending)++;
+}
+
+static void flush_finish(u64 pending) {
+    if (vmm_active && pending > VMM_FLUSH_THRESHOLD) tlb_flush_all();
+}
+
+// Replaces a 1 GiB or 2 MiB leaf with a table of 512 next-size leaves that
+// keep the same frame, permissions and memory type.
+static int split_entry(u64 *entry, int level) {
+    u64 phys;
+    u64 *table = table_alloc(&phys);
+    if (!table) return 0;
+
+    u64 old = *entry;
+    u64 base = entry_phys(old, level);
+    u64 attrs = (old & 0xFFFull & ~PTE_HUGE) | (old & PTE_NX);
+    bool pat = (old & PTE_PAT_HUGE) != 0;
+    u64 step = level_size(level - 1);
+    for (u32 i = 0; i < 512; i++) {
+        u64 child = base + i * step;
+        if (level - 1 > 0) table[i] = child | attrs | PTE_HUGE | (pat ? PTE_PAT_HUGE : 0);
+        else table[i] = child | attrs | (pat ? PTE_PAT_4K : 0);
+    }
+    *entry = phys | PTE_PRESENT | PTE_WRITE;
+
+    count_leaf(level, -1);
+    count_leaf(level - 1, 512);
+    vmm_stats.splits++;
+    return 1;
+}
+
+// Returns the entry that maps virt at the given level, creating missing
+// tables and splitting larger leaves on the way down when asked to.
+static u64 *pte_get(u64 virt, int target, int create) {
+    u64 *table = pml4;
+    for (int level = 3; level > target; level--) {
+        u64 *entry = &table[level_index(virt, level)];
+        if (!(*entry & PTE_PRESENT)) {
+            if (!create) return NULL;
+            u64 phys;
+            if (!table_alloc(&phys)) return NULL;
+            *entry = phys | PTE_PRESENT | PTE_WRITE;
+        } else if (level < 3 && (*entry & PTE_HUGE)) {
+            if (!create || !split_entry(entry, level)) return NULL;
+        }
+        table = entry_table(*entry);
+    }
+    return &table[level_index(virt, target)];
+}
+
+// Returns the leaf mapping virt and its level, or NULL with the level at
+// which the walk found nothing mapped.
+static u64 *pte_find(u64 virt, int *out_level) {
+    u64 *table = pml4;
+    for (int level = 3; level >= 0; level--) {
+        u64 *entry = &table[level_index(virt, level)];
+        *out_level = level;
+        if (!(*entry & PTE_PRESENT)) return NULL;
+        if (level == 0 || (level < 3 && (*entry & PTE_HUGE))) return entry;
+        table = entry_table(*entry);
+    }
+    return NULL;
+}
+
+static int map_range(u64 virt, u64 phys, u64 size, u32 flags) {
+    u64 pending = 0;
+    while (size) {
+        int level = 0;
+        if (vmm_stats.gb_pages && ((virt | phys) & (SIZE_1G - 1)) == 0 && size >= SIZE_1G) {
+            level = 2;
+        } else if (((virt | phys) & (SIZE_2M - 1)) == 0 && size >= SIZE_2M) {
+            level = 1;
+        }
+
+        u64 *entry;
+        for (;;) {
+            entry = pte_get(virt, level, 1);
+            if (!entry) {
+                flush_finish(pending);
+                return -1;
+            }
+            // A slot that already points at a finer table keeps it.
+            if (level > 0 && (*entry & PTE_PRESENT) && !(*entry & PTE_HUGE)) {
+                level--;
+                continue;
+            }
+            break;
+        }
+
+        if (*entry & PTE_PRESENT) {
+            count_leaf(level, -1);
+            flush_page(virt, &pending);
+        }
+        *entry = phys | leaf_bits(flags, level);
+        count_leaf(level, 1);
+
+        virt += level_size(level);
+        phys += level_size(level);
+        size -= level_size(level);
+    }
+    flush_finish(pending);
+    return 0;
+}
+
+static int update_range(u64 virt, u64 size, u32 flags, int unmap) {
+    u64 end = virt + size;
+    u64 pending = 0;
+    while (virt < end) {
+        int level;
+        u64 *entry = pte_find(virt, &level);
+        u64 span = level_size(level);
+        if (!entry) {
+            u64 next = (virt & ~(span - 1)) + span;
+            if (next <= virt) break;
+            virt = next;
+            continue;
+        }
+
+        // Only part of a large page is affected: split it one level and
+        // look again.
+        if (level > 0 && ((virt & (span - 1)) || end - virt < span)) {
+            if (!pte_get(virt, level - 1, 1)) {
+                flush_finish(pending);
+                return -1;
+            }
+            continue;
+        }
+
+        if (unmap) {
+            *entry = 0;
+            count_leaf(level, -1);
+        } else {
+            *entry = entry_phys(*entry, level) | leaf_bits(flags, level);
+        }
+        flush_page(virt, &pending);
+        virt += span;
+    }
+    flush_finish(pending);
+    return 0;
+}
+
+int vmm_map(u64 virt, u64 phys, u64 size, u32 flags) {
+    if (!pml4 || ((virt | phys) & (PAGE_SIZE - 1))) return -1;
+    size = (size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    u64 irq = spin_lock_irqsave(&vmm_lock);
+    int rc = map_range(virt, phys, size, flags);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return rc;
+}
+
+int vmm_unmap(u64 virt, u64 size) {
+    if (!pml4 || (virt & (PAGE_SIZE - 1))) return -1;
+    size = (size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    u64 irq = spin_lock_irqsave(&vmm_lock);
+    int rc = update_range(virt, size, 0, 1);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return rc;
+}
+
+int vmm_protect(u64 virt, u64 size, u32 flags) {
+    if (!pml4 || (virt & (PAGE_SIZE - 1))) return -1;
+    size = (size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    u64 irq = spin_lock_irqsave(&vmm_lock);
+    int rc = update_range(virt, size, flags, 0);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return rc;
+}
+
+int vmm_cache_type(u64 virt) {
+    if (!vmm_active) return -1;
+    int level;
+    u64 irq = spin_lock_irqsave(&vmm_lock);
+    u64 *entry = pte_find(virt, &level);
+    u64 value = entry ? *entry : 0;
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    if (!entry) return -1;
+
+    u8 pat = 0;
+    if (value & PTE_PWT) pat |= 1;
+    if (value & PTE_PCD) pat |= 2;
+    if (value & (level ? PTE_PAT_HUGE : PTE_PAT_4K)) pat |= 4;
+    for (u32 type = 0; type <= (VMM_CACHE_WP >> 4); type++) {
+        if (cache_pat_index[type] == pat) return (int)(type << 4);
+    }
+    return -1;
+}
+
+u64 vmm_translate(u64 virt) {
+    if (!pml4) return 0;
+    int level;
+    u64 irq = spin_lock_irqsave(&vmm_lock);
+    u64 *entry = pte_find(virt, &level);
+    u64 phys = entry ? entry_phys(*entry, level) + (virt & (level_size(level) - 1)) : 0;
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return phys;
+}
+
+void *vmm_map_mmio(u64 phys, u64 size, u32 cache) {
+    // MMIO stays at its direct-map address; only the memory type changes.
+    if (!vmm_active) return phys_to_virt(phys);
+    u64 base = phys & ~(u64)(PAGE_SIZE - 1);
+    u64 end = (phys + size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    if (vmm_map((u64)phys_to_virt(base), base, end - base, VMM_WRITE | cache) != 0) return NULL;
+    return phys_to_virt(phys);
+}
+
+static void cpu_enable_paging_features(void) {
+    if (vmm_stats.pat) wrmsr(MSR_PAT, PAT_LAYOUT);
+    if (vmm_stats.nx) wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    if (vmm_stats.global_pages) write_cr4(read_cr4() | CR4_PGE);
+}
+
+void vmm_init_ap(void) {
+    if (!vmm_active) return;
+    cpu_enable_paging_features();
+    if (gdt_ptr.base) asm volatile("lgdt %0" : : "m"(gdt_ptr));
+    write_cr3(pml4_phys);
+    // The new PAT layout must not meet stale TLB entries from the old one.
+    if (vmm_stats.global_pages) tlb_flush_all();
+}
+
+void vmm_init(u64 kernel_phys_base, u64 kernel_virt_base) {
+    u32 eax, ebx, ecx, edx;
+    spin_lock_profile(&vmm_lock, "vmm", -1);
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    vmm_stats.global_pages = (edx & (1u << 13)) != 0;
+    vmm_stats.pat = (edx & (1u << 16)) != 0;
+    if (vmm_stats.pat) cache_pat_index = cache_pat_kernel;
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpu_cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        vmm_stats.nx = (edx & (1u << 20)) != 0;
+        vmm_stats.gb_pages = (edx & (1u << 26)) != 0;
+    }
+
+    pml4 = table_alloc(&pml4_phys);
+    if (!pml4) return;
+
+    // Direct map of all physical memory (and at least the low 4 GiB, where
+    // the MMIO holes live) at the HHDM offset, in the largest pages possible.
+    u64 top = pmm_phys_top();
+    if (top < 4 * SIZE_1G) top = 4 * SIZE_1G;
+    top = (top + SIZE_1G - 1) & ~(SIZE_1G - 1);
+    vmm_stats.direct_map_base = memory_hhdm_offset();
+    vmm_stats.direct_map_size = top;
+
+    u64 rodata = (u64)__rodata_start;
+    u64 data = (u64)__data_start;
+    u64 end = ((u64)__kernel_end + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    if (map_range(vmm_stats.direct_map_base, 0, top, VMM_WRITE) != 0 ||
+        map_range(kernel_virt_base, kernel_phys_base,
+                  rodata - kernel_virt_base, VMM_EXEC) != 0 ||
+        map_range(rodata, kernel_phys_base + (rodata - kernel_virt_base),
+                  data - rodata, 0) != 0 ||
+        map_range(data, kernel_phys_base + (data - kernel_virt_base),
+                  end - data, VMM_WRITE) != 0) {
+        // Keep running on the bootloader's tables.
+        pml4 = NULL;
+        return;
+    }
+
+    descriptor_ptr_t current;
+    asm volatile("sgdt %0" : "=m"(current));
+    if ((u64)current.limit + 1 <= sizeof(gdt)) {
+        memcpy(gdt, (void *)current.base, (size_t)current.limit + 1);
+        gdt_ptr.limit = current.limit;
+        gdt_ptr.base = (u64)gdt;
+    }
+
+    vmm_active = true;
+    vmm_init_ap();
+}
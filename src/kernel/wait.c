@@ -0,0 +1,114 @@
+#include "kernel/wait.h"
+
+void wait_queue_init(wait_queue_t *wq) {
+    spin_lock_init(&wq->lock);
+    wq->head = 0;
+}
+
+// The task is marked as blocking before it is queued, with interrupts off
+// so it cannot be preempted in between: a waker that finds the entry
+// always sees a task it can wake.
+void wait_prepare(wait_queue_t *wq, wait_entry_t *entry, u64 deadline) {
+    u64 flags = irq_save();
+    task_block_prepare(deadline);
+    entry->task = task_current();
+    entry->next = 0;
+    spin_lock(&wq->lock);
+    wait_entry_t **link = &wq->head;
+    while (*link) link = &(*link)->next;
+    *link = entry;
+    spin_unlock(&wq->lock);
+    // Pairs with the fence in wake_up: either the waker sees this entry
+    // or the caller's recheck of the condition sees the waker's store.
+    __sync_synchronize();
+    irq_restore(flags);
+}
+
+void wait_finish(wait_queue_t *wq, wait_entry_t *entry) {
+    u64 flags = spin_lock_irqsave(&wq->lock);
+    wait_entry_t **link = &wq->head;
+    while (*link && *link != entry) link = &(*link)->next;
+    if (*link) *link = entry->next;
+    spin_unlock_irqrestore(&wq->lock, flags);
+    task_block_finish();
+}
+
+void wake_up(wait_queue_t *wq) {
+    __sync_synchronize();
+    if (!wq->head) return;
+    u64 flags = spin_lock_irqsave(&wq->lock);
+    wait_entry_t *entry = wq->head;
+    wq->head = 0;
+    while (entry) {
+        wait_entry_t *next = entry->next;
+        task_unblock(entry->task);
+        entry = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void wake_up_one(wait_queue_t *wq) {
+    __sync_synchronize();
+    if (!wq->head) return;
+    u64 flags = spin_lock_irqsave(&wq->lock);
+    wait_entry_t *entry = wq->head;
+    if (entry) {
+        wq->head = entry->next;
+        task_unblock(entry->task);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void mutex_init(mutex_t *m) {
+    m->locked = 0;
+    wait_queue_init(&m->wait);
+}
+
+void mutex_lock(mutex_t *m) {
+    while (__sync_lock_test_and_set(&m->locked, 1)) {
+        wait_event(m->wait, !m->locked);
+    }
+}
+
+int mutex_trylock(mutex_t *m) {
+    return __sync_lock_test_and_set(&m->locked, 1) == 0;
+}
+
+void mutex_unlock(mutex_t *m) {
+    __sync_lock_release(&m->locked);
+    wake_up_one(&m->wait);
+}
+
+void sem_init(semaphore_t *s, int count) {
+    s->count = count;
+    wait_queue_init(&s->wait);
+}
+
+int sem_trydown(semaphore_t *s) {
+    for (;;) {
+        int count = s->count;
+        if (count <= 0) return 0;
+        if (__sync_bool_compare_and_swap(&s->count, count, count - 1)) return 1;
+    }
+}
+
+void sem_down(semaphore_t *s) {
+    while (!sem_trydown(s)) {
+        wait_event(s->wait, s->count > 0);
+    }
+}
+
+int sem_down_timeout(semaphore_t *s, u64 timeout) {
+    u64 deadline = ticks_now() + timeout;
+    while (!sem_trydown(s)) {
+        u64 now = ticks_now();
+        if (now >= deadline) return 0;
+        wait_event_timeout(s->wait, s->count > 0, deadline - now);
+    }
+    return 1;
+}
+
+void sem_up(semaphore_t *s) {
+    __sync_fetch_and_add(&s->count, 1);
+    wake_up_one(&s->wait);
+}
@@ -1,6 +1,24 @@
 #include "services/log.h"
 #include "drivers/serial.h"
 #include "kernel/cpu.h"
+#include "kernel/ring.h"
+
+#define LOG_RING_SIZE 64
+#define LOG_TEXT_MAX 120
+
+// Writers on any CPU queue whole lines; whoever finds the serial port free
+// drains the ring, so concurrent lines never interleave mid-line and a
+// writer that interrupts the drainer just leaves its line for it.
+typedef struct {
+    u8 level;
+    char text[LOG_TEXT_MAX];
+} log_record_t;
+
+static u8 log_storage[MPSC_STORAGE_SIZE(LOG_RING_SIZE, sizeof(log_record_t))] __attribute__((aligned(8)));
+static mpsc_ring_t log_ring;
+static bool log_ready = false;
+static volatile int log_draining = 0;
+u64 log_dropped = 0;
 
 static const char *level_to_str(log_level_t level) {
     switch (level) {
@@ -35,9 +53,10 @@ static void u64_to_dec(char *out, int max, u64 value) {
 
 void log_init(void) {
     serial_init();
+    log_ready = mpsc_init(&log_ring, log_storage, LOG_RING_SIZE, sizeof(log_record_t)) == 0;
 }
 
-void log_write(log_level_t level, const char *msg) {
+static void log_emit(log_level_t level, const char *msg) {
     serial_write_str("[");
     serial_write_str(level_to_str(level));
     serial_write_str("] ");
@@ -47,6 +66,42 @@ void log_write(log_level_t level, const char *msg) {
     serial_write_str("\n");
 }
 
+static void log_drain(void) {
+    log_record_t rec;
+    while (!__atomic_exchange_n(&log_draining, 1, __ATOMIC_ACQUIRE)) {
+        while (mpsc_pop(&log_ring, &rec)) log_emit((log_level_t)rec.level, rec.text);
+        // Sequentially consistent so the release cannot pass the check
+        // below; a writer's publish is ordered by its own exchange.
+        __atomic_store_n(&log_draining, 0, __ATOMIC_SEQ_CST);
+        // A line published after the last pop, whose writer found the flag
+        // still held, would otherwise wait for the next writer. A slot that
+        // is reserved but not yet published is left to its writer, which
+        // drains after it publishes; it may be the code this call
+        // interrupted, so spinning on it could never end.
+        if (!mpsc_ready(&log_ring)) break;
+    }
+}
+
+// Lines longer than LOG_TEXT_MAX - 1 are cut short.
+void log_write(log_level_t level, const char *msg) {
+    if (!log_ready) {
+        log_emit(level, msg);
+        return;
+    }
+    log_record_t rec;
+    rec.level = (u8)level;
+    u32 len = 0;
+    if (msg) {
+        while (msg[len] && len < LOG_TEXT_MAX - 1) {
+            rec.text[len] = msg[len];
+            len++;
+        }
+    }
+    rec.text[len] = 0;
+    if (!mpsc_push(&log_ring, &rec)) __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+    log_drain();
+}
+
 void panic(const char *file, int line, const char *msg) {
     char buf[24];
     asm volatile("cli");
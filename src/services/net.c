@@ -2,6 +2,10 @@
 #include "drivers/e1000.h"
 #include "kernel/cpu.h"
 #include "kernel/memory.h"
+#include "kernel/timer.h"
+#include "kernel/wait.h"
+#include "kernel/softirq.h"
+#include "kernel/ring.h"
 
 #define ETH_TYPE_IPV4 0x0800
 #define ETH_TYPE_ARP  0x0806
@@ -21,6 +25,12 @@
 #define TCP_FLAG_ACK 0x10
 
 #define ARP_CACHE_SIZE 8
+// RX frames handled per net_poll before other tasks get a turn.
+#define NET_RX_BUDGET 64
+
+#define TCP_RTO_TICKS     (PIT_HZ + 1)
+#define DHCP_RETRY_TICKS  (PIT_HZ * 2 + 1)
+#define DNS_TIMEOUT_TICKS (PIT_HZ * 3)
 
 typedef struct {
     u8 dst[6];
@@ -128,7 +138,8 @@ static dhcp_state_t dhcp_state = DHCP_INIT;
 static u32 dhcp_xid = 0;
 static u32 dhcp_server = 0;
 static u32 dhcp_offer_ip = 0;
-static u64 dhcp_last_send = 0;
+static ktimer_t dhcp_timer;
+static volatile int dhcp_timeout = 0;
 
 typedef enum {
     TCP_CLOSED = 0,
@@ -146,21 +157,56 @@ typedef struct {
     u32 snd_nxt;
     u32 snd_una;
     u32 rcv_nxt;
+    // Filled by the RX path under net_lock, drained by net_tcp_recv
+    // without it.
     u8 recv_buf[65536];
-    u32 recv_len;
-    u32 recv_read;
+    spsc_ring_t recv_ring;
     u8 last_payload[1460];
     u16 last_len;
     u8 last_flags;
     u32 last_seq;
-    u64 last_send_tick;
     int waiting_ack;
+    ktimer_t rto_timer;
+    volatile int rto_expired;
 } tcp_conn_t;
 
 static tcp_conn_t tcp_conn;
 static int dns_pending = 0;
 static u16 dns_txid = 0;
 static u32 dns_result_ip = 0;
+static ktimer_t dns_timer;
+static volatile int dns_timeout = 0;
+
+// Received frames are handled by net_rx_work, which the NIC interrupt
+// queues on the kworker of the CPU it arrived on. The net task sleeps on
+// net_work until a timer gives it something to do. Callers waiting for a
+// reply sleep on net_events, which every net_poll wakes. net_lock
+// serialises the stack between all of them.
+static wait_queue_t net_work;
+static wait_queue_t net_events;
+static mutex_t net_lock;
+static work_t net_rx_work;
+
+// Timer callbacks run in the PIT interrupt, so they only raise a flag for
+// net_poll to act on from task context.
+static void net_timer_expired(void *arg) {
+    *(volatile int *)arg = 1;
+    wake_up(&net_work);
+}
+
+static void net_event_timer(void *arg) {
+    *(volatile int *)arg = 1;
+    wake_up(&net_events);
+}
+
+static void net_irq(void) {
+    work_queue(&net_rx_work);
+}
+
+// One RX budget per run; a longer burst requeues behind any other work.
+static void net_rx(work_t *work) {
+    if (net_poll()) work_queue(work);
+}
 
 static u16 net_htons(u16 v) {
     return (u16)((v << 8) | (v >> 8));
@@ -385,7 +431,8 @@ static void dhcp_send_discover(void) {
 
     net_send_udp(0xFFFFFFFFu, DHCP_CLIENT_PORT, DHCP_SERVER_PORT,
                  (u8 *)&msg, (u16)(sizeof(msg) - sizeof(msg.options) + (opt - msg.options)));
-    dhcp_last_send = ticks;
+    dhcp_timeout = 0;
+    timer_add(&dhcp_timer, ticks_now() + DHCP_RETRY_TICKS, net_timer_expired, (void *)&dhcp_timeout);
     dhcp_state = DHCP_DISCOVER_SENT;
 }
 
@@ -421,7 +468,8 @@ static void dhcp_send_request(void) {
 
     net_send_udp(0xFFFFFFFFu, DHCP_CLIENT_PORT, DHCP_SERVER_PORT,
                  (u8 *)&msg, (u16)(sizeof(msg) - sizeof(msg.options) + (opt - msg.options)));
-    dhcp_last_send = ticks;
+    dhcp_timeout = 0;
+    timer_add(&dhcp_timer, ticks_now() + DHCP_RETRY_TICKS, net_timer_expired, (void *)&dhcp_timeout);
     dhcp_state = DHCP_REQUEST_SENT;
 }
 
@@ -472,6 +520,7 @@ static void dhcp_handle(const u8 *payload, u16 len) {
         gateway = router;
         dns_server = dns;
         dhcp_state = DHCP_BOUND;
+        timer_cancel(&dhcp_timer);
         net_ready = 1;
     }
 }
@@ -551,7 +600,8 @@ static void tcp_send_segment(u8 flags, const u8 *data, u16 len) {
                                  (u16)(sizeof(tcp_hdr_t) + len));
     net_send_ipv4(tcp_conn.dest_ip, IP_PROTO_TCP, packet,
                   (u16)(sizeof(tcp_hdr_t) + len));
-    tcp_conn.last_send_tick = ticks;
+    tcp_conn.rto_expired = 0;
+    timer_add(&tcp_conn.rto_timer, ticks_now() + TCP_RTO_TICKS, net_timer_expired, (void *)&tcp_conn.rto_expired);
     tcp_conn.last_flags = flags;
     tcp_conn.last_seq = tcp_conn.snd_nxt;
     tcp_conn.last_len = len;
@@ -609,10 +659,9 @@ static void tcp_handle(const u8 *payload, u16 len, u32 src_ip) {
             }
         }
         if (data_len > 0 && seq == tcp_conn.rcv_nxt) {
-            u32 space = (u32)(sizeof(tcp_conn.recv_buf) - tcp_conn.recv_len);
-            if (data_len > space) data_len = (u16)space;
-            memcpy(tcp_conn.recv_buf + tcp_conn.recv_len, data, data_len);
-            tcp_conn.recv_len += data_len;
+            // Whatever does not fit is left unacknowledged for the peer
+            // to send again.
+            data_len = (u16)spsc_enqueue(&tcp_conn.recv_ring, data, data_len);
             tcp_conn.rcv_nxt += data_len;
             tcp_send_segment(TCP_FLAG_ACK, NULL, 0);
         }
@@ -676,29 +725,50 @@ static void net_rx_frame(const u8 *data, u16 len) {
 }
 
 void net_init(void) {
+    wait_queue_init(&net_work);
+    wait_queue_init(&net_events);
+    mutex_init(&net_lock);
+    work_init(&net_rx_work, net_rx);
+    spsc_init(&tcp_conn.recv_ring, tcp_conn.recv_buf, sizeof(tcp_conn.recv_buf), 1);
     for (int i = 0; i < ARP_CACHE_SIZE; i++) arp_cache[i].valid = 0;
     net_ready = 0;
     dhcp_state = DHCP_INIT;
     dhcp_offer_ip = 0;
     dhcp_server = 0;
-    dhcp_last_send = 0;
+    dhcp_timeout = 0;
 
     if (!e1000_init(local_mac)) return;
     e1000_set_rx_callback(net_rx_frame);
+    e1000_set_irq_callback(net_irq);
 
     dhcp_xid = (u32)(ticks ^ 0xA5A5A5A5u);
     dhcp_send_discover();
 
     tcp_conn.state = TCP_CLOSED;
-    tcp_conn.recv_len = 0;
-    tcp_conn.recv_read = 0;
 }
 
-void net_poll(void) {
-    e1000_poll();
+static int net_work_pending(void) {
+    return tcp_conn.rto_expired || dhcp_timeout;
+}
 
-    if (tcp_conn.state == TCP_SYN_SENT || tcp_conn.waiting_ack) {
-        if (ticks - tcp_conn.last_send_tick > PIT_HZ) {
+int net_wait_work(u64 timeout) {
+    return wait_event_timeout(net_work, net_work_pending(), timeout);
+}
+
+int net_wait_until(int (*cond)(void), u64 timeout) {
+    return wait_event_timeout(net_events, cond(), timeout);
+}
+
+// Handles at most NET_RX_BUDGET frames, then timers. Returns nonzero if
+// the RX ring still has frames, so the caller can yield and come back
+// instead of starving everyone else during a burst.
+int net_poll(void) {
+    mutex_lock(&net_lock);
+    int more = e1000_rx_poll(NET_RX_BUDGET) == NET_RX_BUDGET;
+
+    if (tcp_conn.rto_expired) {
+        tcp_conn.rto_expired = 0;
+        if (tcp_conn.state == TCP_SYN_SENT || tcp_conn.waiting_ack) {
             if (tcp_conn.last_flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) {
                 tcp_conn.snd_nxt = tcp_conn.last_seq;
                 tcp_send_segment(tcp_conn.last_flags, NULL, 0);
@@ -709,12 +779,13 @@ void net_poll(void) {
         }
     }
 
-    if (dhcp_state != DHCP_BOUND) {
-        u64 elapsed = ticks - dhcp_last_send;
-        if (elapsed > (PIT_HZ * 2)) {
-            dhcp_send_discover();
-        }
+    if (dhcp_timeout) {
+        dhcp_timeout = 0;
+        if (dhcp_state != DHCP_BOUND) dhcp_send_discover();
     }
+    mutex_unlock(&net_lock);
+    wake_up(&net_events);
+    return more;
 }
 
 int net_is_up(void) {
@@ -769,15 +840,16 @@ int net_dns_resolve(const char *host, u32 *out_ip) {
     *p++ = 0;
     *p++ = 1;
 
+    dns_timeout = 0;
+    timer_add(&dns_timer, ticks_now() + DNS_TIMEOUT_TICKS, net_event_timer, (void *)&dns_timeout);
+    mutex_lock(&net_lock);
     net_send_udp(dns_server, DNS_CLIENT_PORT, DNS_SERVER_PORT, packet, (u16)(p - packet));
-    u64 start = ticks;
-    while (ticks - start < PIT_HZ * 3) {
-        net_poll();
-        if (!dns_pending && dns_result_ip != 0) {
-            if (out_ip) *out_ip = dns_result_ip;
-            return 1;
-        }
-        cpu_sleep_ticks(1);
+    mutex_unlock(&net_lock);
+    wait_event(net_events, dns_timeout || (!dns_pending && dns_result_ip != 0));
+    timer_cancel(&dns_timer);
+    if (!dns_pending && dns_result_ip != 0) {
+        if (out_ip) *out_ip = dns_result_ip;
+        return 1;
     }
     dns_pending = 0;
     return 0;
@@ -785,17 +857,18 @@ int net_dns_resolve(const char *host, u32 *out_ip) {
 
 int net_tcp_connect(u32 dest_ip, u16 dest_port) {
     if (!net_is_up()) return 0;
+    mutex_lock(&net_lock);
     tcp_conn.dest_ip = dest_ip;
     tcp_conn.dest_port = dest_port;
     tcp_conn.src_port = (u16)(1024 + (ticks % 40000));
     tcp_conn.snd_nxt = (u32)(ticks ^ 0xA5A5C3u);
     tcp_conn.snd_una = tcp_conn.snd_nxt;
     tcp_conn.rcv_nxt = 0;
-    tcp_conn.recv_len = 0;
-    tcp_conn.recv_read = 0;
+    spsc_reset(&tcp_conn.recv_ring);
     tcp_conn.waiting_ack = 0;
     tcp_conn.state = TCP_SYN_SENT;
     tcp_send_segment(TCP_FLAG_SYN, NULL, 0);
+    mutex_unlock(&net_lock);
     return 1;
 }
 
@@ -807,18 +880,19 @@ int net_tcp_send(const u8 *data, u16 len) {
     if (tcp_conn.state != TCP_ESTABLISHED) return 0;
     if (len == 0) return 0;
     if (len > sizeof(tcp_conn.last_payload)) len = (u16)sizeof(tcp_conn.last_payload);
+    mutex_lock(&net_lock);
     tcp_send_segment(TCP_FLAG_ACK | TCP_FLAG_PSH, data, len);
+    mutex_unlock(&net_lock);
     return 1;
 }
 
 int net_tcp_recv(u8 *out, u16 max) {
     if (!out || max == 0) return 0;
-    u32 available = tcp_conn.recv_len - tcp_conn.recv_read;
-    if (available == 0) return 0;
-    if (available > max) available = max;
-    memcpy(out, tcp_conn.recv_buf + tcp_conn.recv_read, available);
-    tcp_conn.recv_read += available;
-    return (int)available;
+    return (int)spsc_dequeue(&tcp_conn.recv_ring, out, max);
+}
+
+int net_tcp_available(void) {
+    return spsc_count(&tcp_conn.recv_ring) != 0;
 }
 
 int net_tcp_is_closed(void) {
@@ -826,8 +900,10 @@ int net_tcp_is_closed(void) {
 }
 
 void net_tcp_close(void) {
+    mutex_lock(&net_lock);
     if (tcp_conn.state == TCP_ESTABLISHED) {
         tcp_send_segment(TCP_FLAG_FIN | TCP_FLAG_ACK, NULL, 0);
         tcp_conn.state = TCP_FIN_WAIT;
     }
+    mutex_unlock(&net_lock);
 }
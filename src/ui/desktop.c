@@ -6,6 +6,8 @@
 #include "apps/file_manager.h"
 #include "kernel/memory.h"
 #include "kernel/cpu.h"
+#include "kernel/clock.h"
+#include "kernel/histogram.h"
 #include "services/net.h"
 #include "apps/browser.h"
 #include "kernel/interrupts.h"
@@ -168,7 +170,7 @@ static void draw_debug_overlay(u32 fps) {
     int x = 8;
     int y = 8;
     int w = 220;
-    int h = 92;
+    int h = 128;
     gfx_draw_rect(x, y, w, h, theme->panel);
     gfx_draw_rect(x, y, w, 1, theme->panel_border);
     gfx_draw_text("Debug", x + 8, y + 6, theme->accent);
@@ -181,7 +183,7 @@ static void draw_debug_overlay(u32 fps) {
     line += FONT_HEIGHT;
 
     gfx_draw_text("Ticks:", x + 8, line, theme->text_muted);
-    u64_to_dec(buf, (int)sizeof(buf), ticks);
+    u64_to_dec(buf, (int)sizeof(buf), ticks_now());
     gfx_draw_text(buf, x + 60, line, theme->text);
     line += FONT_HEIGHT;
 
@@ -193,6 +195,13 @@ static void draw_debug_overlay(u32 fps) {
     gfx_draw_text("IRQ1:", x + 8, line, theme->text_muted);
     u64_to_dec(buf, (int)sizeof(buf), interrupts_get_irq_count(1));
     gfx_draw_text(buf, x + 60, line, theme->text);
+    line += FONT_HEIGHT;
+
+    // Cost of the last full-screen present, in thousands of TSC cycles.
+    gfx_draw_text("Blit:", x + 8, line, theme->text_muted);
+    u64_to_dec(buf, (int)sizeof(buf), gfx_present_cycles() / 1000);
+    gfx_draw_text(buf, x + 60, line, theme->text);
+    gfx_draw_text("kcyc", x + 60 + text_width(buf) + FONT_WIDTH, line, theme->text_muted);
 
     u64 total_mb = (pmm_total_pages * 4096) / (1024 * 1024);
     u64 free_mb = (pmm_free_pages * 4096) / (1024 * 1024);
@@ -691,6 +700,10 @@ static void draw_window(window_t *win) {
         gfx_draw_text(hbuf, rx, sy, theme->text);
         sy += FONT_HEIGHT + 6;
 
+        gfx_draw_text("Framebuffer:", sx, sy, theme->text);
+        gfx_draw_text(gfx_memory_type(), sx + 120, sy, theme->text);
+        sy += FONT_HEIGHT + 6;
+
         gfx_draw_text("Memory Total (MB):", sx, sy, theme->text);
         u64 total_mb = (pmm_total_pages * 4096) / (1024 * 1024);
         char total_buf[16];
@@ -706,6 +719,7 @@ static void draw_window(window_t *win) {
         sy += FONT_HEIGHT + 6;
 
         gfx_draw_text("Heap Used (KB):", sx, sy, theme->text);
+        heap_update_stats();
         u64 heap_used_kb = (heap_allocated - heap_freed) / 1024;
         char heap_buf[16];
         u64_to_dec(heap_buf, (int)sizeof(heap_buf), heap_used_kb);
@@ -1012,32 +1026,39 @@ void desktop_init(void) {
     desktop_create_window(APP_TERMINAL);
 }
 
+// Input arrival to the first frame presented after it, in microseconds.
+static histogram_t input_latency;
+
+histogram_t *desktop_input_latency(void) {
+    return &input_latency;
+}
+
 void desktop_loop(void) {
     u64 last_tick = 0;
     u64 last_uptime = uptime_seconds;
     u32 idle_accum = 0;
-    u64 fps_last_tick = ticks;
+    u64 fps_last_ns = clock_monotonic_ns();
     u32 fps_frames = 0;
     u32 fps_value = 0;
-    u64 overlay_last_tick = ticks;
+    u64 overlay_last_tick = ticks_now();
     int overlay_dirty = 0;
-    u64 net_last_tick = 0;
 
     int dirty_full = 1;
     int dirty_panel = 1;
     int dirty_window = -1;
     int cursor_dirty = 1;
+    u64 input_since_ns = 0;
     while (1) {
         int activity = 0;
-        if (ticks != net_last_tick) {
-            net_poll();
-            net_last_tick = ticks;
-        }
-        if (settings.debug_overlay && (ticks - overlay_last_tick) >= PIT_HZ) {
-            overlay_last_tick = ticks;
+        u64 overlay_tick = ticks_now();
+        if (settings.debug_overlay && (overlay_tick - overlay_last_tick) >= PIT_HZ) {
+            overlay_last_tick = overlay_tick;
             overlay_dirty = 1;
         }
 
+        u64 arrival = input_take_arrival_ns();
+        if (arrival && !input_since_ns) input_since_ns = arrival;
+
         key_event_t key;
         while (input_poll_key(&key)) {
             if (key.pressed && key.keycode == KEY_WIN) {
@@ -1206,6 +1227,12 @@ handle_active:
         if (uptime_seconds != last_uptime) {
             last_uptime = uptime_seconds;
             dirty_panel = 1;
+            for (int i = 0; i < window_count; i++) {
+                if (windows[i].type != APP_TERMINAL || windows[i].minimized) continue;
+                if (!shell_tick(&windows[i].shell)) continue;
+                if (i == active_index && dirty_window < 0) dirty_window = i;
+                else dirty_full = 1;
+            }
         }
 
         if (mouse_buttons != prev_mouse_buttons) {
@@ -1230,16 +1257,19 @@ handle_active:
             }
         }
 
-        if (ticks == last_tick) {
-            // If the timer IRQ stalls, keep polling input so mouse/keyboard still work.
+        u64 now_tick = ticks_now();
+        if (now_tick == last_tick) {
+            // Sleep until input arrives or the next tick; the input
+            // interrupt wakes us even if the timer stalls.
             if (!activity) {
-                asm volatile("pause");
+                input_wait(1);
                 continue;
             }
         }
-        last_tick = ticks;
+        last_tick = now_tick;
 
         int need_render = dirty_full || dirty_panel || dirty_window >= 0 || cursor_dirty || overlay_dirty;
+        if (!need_render) input_since_ns = 0;
         if (!activity && !need_render) {
             idle_accum += (u32)settings.idle_fps;
             if (idle_accum < PIT_HZ) {
@@ -1298,7 +1328,7 @@ handle_active:
 
         if (!did_full && settings.debug_overlay && overlay_dirty) {
             draw_debug_overlay(fps_value);
-            gfx_present_rect(8, 8, 220, 92);
+            gfx_present_rect(8, 8, 220, 128);
             overlay_dirty = 0;
             presented = 1;
         }
@@ -1325,13 +1355,18 @@ handle_active:
 
         if (presented) {
             fps_frames++;
+            if (input_since_ns) {
+                histogram_record(&input_latency, (clock_monotonic_ns() - input_since_ns) / NSEC_PER_USEC);
+                input_since_ns = 0;
+            }
         }
 
-        if (ticks - fps_last_tick >= PIT_HZ) {
-            u64 delta = ticks - fps_last_tick;
-            fps_value = (u32)((fps_frames * PIT_HZ) / (delta ? delta : 1));
+        u64 now_ns = clock_monotonic_ns();
+        if (now_ns - fps_last_ns >= NSEC_PER_SEC) {
+            u64 delta = now_ns - fps_last_ns;
+            fps_value = (u32)(((u64)fps_frames * NSEC_PER_SEC) / delta);
             fps_frames = 0;
-            fps_last_tick = ticks;
+            fps_last_ns = now_ns;
             if (settings.debug_overlay) overlay_dirty = 1;
         }
     }